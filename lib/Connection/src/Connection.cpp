@@ -0,0 +1,153 @@
+/** @file
+ * Keeps the WiFi and MQTT connections up without blocking loop().
+ */
+
+#include "Connection.h"
+
+Connection::Connection(PubSubClient& client, const char* ssid, const char* password) :
+  client(client),
+  ssid(ssid),
+  password(password) {
+}
+
+void Connection::setMqtt(const char* id, const char* user, const char* pass) {
+  mqttId = id;
+  mqttUser = user;
+  mqttPass = pass;
+}
+
+bool Connection::subscribe(const char* topic, uint8_t qos) {
+  if (topicCount >= CONNECTION_MAX_TOPICS) return false;
+  topics[topicCount] = topic;
+  topicQos[topicCount++] = qos;
+  return true;
+}
+
+void Connection::update() {
+  uint8_t step = connectionState == CONNECTION_BACKOFF ? retryState : connectionState;
+  if (step >= CONNECTION_MQTT_CONNECT && !halWifiConnected()) {
+    Serial.println("WiFi connection lost");
+    enter(CONNECTION_WIFI_WAIT); // The ESP reconnects by itself, WiFi.begin() only after a timeout
+  }
+  switch (connectionState) {
+    case CONNECTION_WIFI_START:
+      Serial.print("Connecting to ");
+      Serial.println(ssid);
+      halWifiBegin(ssid, password);
+      enter(CONNECTION_WIFI_WAIT);
+      break;
+    case CONNECTION_WIFI_WAIT:
+      if (halWifiConnected()) {
+        uint32_t address = halWifiAddress();
+        Serial.print("WiFi connected, IP address: ");
+        for (uint8_t i = 0; i < 4; i++) {
+          if (i) Serial.print('.');
+          Serial.print((address >> (8 * i)) & 0xFF);
+        }
+        Serial.print(", signaal sterkte (RSSI): ");
+        Serial.print((long)halWifiRssi());
+        Serial.println(" dBm");
+        enter(CONNECTION_MQTT_CONNECT);
+      }
+      else if (millis() - stateTime >= CONNECTION_WIFI_TIMEOUT) retry(CONNECTION_WIFI_START);
+      break;
+    case CONNECTION_MQTT_CONNECT:
+      if (client.connectAsync(mqttId, mqttUser, mqttPass)) enter(CONNECTION_MQTT_WAIT);
+      else {
+        Serial.print("MQTT connect failed, state ");
+        Serial.println(client.state());
+        retry(CONNECTION_MQTT_CONNECT);
+      }
+      break;
+    case CONNECTION_MQTT_WAIT:
+      switch (client.poll()) {
+        case MQTT_CONNECTING:
+          break;
+        case MQTT_CONNECTED:
+          Serial.println("Connected to MQTT Broker!");
+          connectCount++;
+          enter(CONNECTION_SUBSCRIBE);
+          break;
+        default:
+          Serial.print("MQTT broker refused, state ");
+          Serial.println(client.state());
+          retry(CONNECTION_MQTT_CONNECT);
+      }
+      break;
+    case CONNECTION_SUBSCRIBE:
+      if (topicCount == 0) {
+        backoff = CONNECTION_BACKOFF_MIN;
+        enter(CONNECTION_CONNECTED);
+        break;
+      }
+      client.onSuback([this](uint16_t msgId, uint8_t* codes, uint8_t count) { suback(msgId, codes, count); });
+      subscribeId = client.subscribe(topics, topicQos, topicCount);
+      if (subscribeId) enter(CONNECTION_SUBACK_WAIT);
+      else {
+        Serial.println("MQTT subscribe failed");
+        client.disconnect();
+        retry(CONNECTION_MQTT_CONNECT);
+      }
+      break;
+    case CONNECTION_SUBACK_WAIT:
+      if (subscribeId == 0) { // suback() was called by client.loop()
+        backoff = CONNECTION_BACKOFF_MIN;
+        enter(CONNECTION_CONNECTED);
+      }
+      else if (!client.connected()) {
+        Serial.println("MQTT connection lost");
+        enter(CONNECTION_MQTT_CONNECT);
+      }
+      else if (millis() - stateTime >= CONNECTION_SUBACK_TIMEOUT) {
+        Serial.println("No SUBACK from the MQTT broker");
+        client.disconnect();
+        retry(CONNECTION_MQTT_CONNECT);
+      }
+      break;
+    case CONNECTION_CONNECTED:
+      if (!client.connected()) {
+        Serial.println("MQTT connection lost");
+        enter(CONNECTION_MQTT_CONNECT);
+      }
+      break;
+    case CONNECTION_BACKOFF:
+      if (millis() - stateTime >= backoff) {
+        backoff = backoff * 2 > CONNECTION_BACKOFF_MAX ? CONNECTION_BACKOFF_MAX : backoff * 2;
+        enter(retryState);
+      }
+      break;
+  }
+}
+
+bool Connection::connected() {
+  return connectionState == CONNECTION_CONNECTED;
+}
+
+uint8_t Connection::state() {
+  return connectionState;
+}
+
+uint32_t Connection::connects() {
+  return connectCount;
+}
+
+void Connection::enter(uint8_t state) {
+  connectionState = state;
+  stateTime = millis();
+}
+
+// Reports the subscriptions the broker confirmed or refused
+void Connection::suback(uint16_t msgId, uint8_t* codes, uint8_t count) {
+  if (msgId != subscribeId) return;
+  for (uint8_t i = 0; i < count && i < topicCount; i++) {
+    Serial.print(codes[i] == MQTT_SUBACK_FAILURE ? "Subscription refused : " : "Listening to topic : ");
+    Serial.println(topics[i]);
+  }
+  subscribeId = 0;
+}
+
+// Waits in CONNECTION_BACKOFF before state is tried again
+void Connection::retry(uint8_t state) {
+  retryState = state;
+  enter(CONNECTION_BACKOFF);
+}
@@ -0,0 +1,124 @@
+/** @file
+ * Keeps the WiFi and MQTT connections up without blocking loop().
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "Hal.h"
+#include "PubSubClient.h"
+
+/**
+ * Maximum number of topics that are subscribed to after every (re)connect.
+ */
+#ifndef CONNECTION_MAX_TOPICS
+#define CONNECTION_MAX_TOPICS 4
+#endif
+
+/**
+ * Waiting time in ms after the first failed attempt. It doubles with every failed attempt up to
+ * CONNECTION_BACKOFF_MAX and is reset once the connection is up.
+ */
+#define CONNECTION_BACKOFF_MIN 500
+#define CONNECTION_BACKOFF_MAX 60000
+
+/**
+ * Time in ms to wait for the WiFi association before WiFi.begin() is called again.
+ */
+#define CONNECTION_WIFI_TIMEOUT 20000
+
+/**
+ * Time in ms to wait for the SUBACK before the broker connection is set up again.
+ */
+#define CONNECTION_SUBACK_TIMEOUT 10000
+
+/**
+ * Connection states.
+ */
+#define CONNECTION_WIFI_START   0 // WiFi.begin() is called on the next update()
+#define CONNECTION_WIFI_WAIT    1 // Waiting for the access point
+#define CONNECTION_MQTT_CONNECT 2 // Connect to the broker on the next update()
+#define CONNECTION_MQTT_WAIT    3 // Waiting for the broker to accept the connection
+#define CONNECTION_SUBSCRIBE    4 // Subscribe to all topics on the next update()
+#define CONNECTION_SUBACK_WAIT  5 // Waiting for the broker to confirm the subscriptions
+#define CONNECTION_CONNECTED    6
+#define CONNECTION_BACKOFF      7 // Waiting before the failed step is tried again
+
+/**
+ * State machine for the WiFi and MQTT connections.
+ *
+ * Every call to update() does at most one step and returns, so the dimmer, the button and
+ * everything else in loop() keep running while the network is down. The WiFi station is reached
+ * through the HAL, so the host build can run the state machine against simulated outages. Failed steps are retried
+ * with exponential backoff. All topics are subscribed in one SUBSCRIBE packet; the connection
+ * manager installs the onSuback() handler of the client for that.
+ */
+class Connection {
+  public:
+    /**
+     * Constructor.
+     *
+     * @param client MQTT client, its server must be set before the first update().
+     * @param ssid WiFi network.
+     * @param password WiFi password.
+     */
+    Connection(PubSubClient& client, const char* ssid, const char* password);
+
+    /**
+     * Sets the MQTT credentials. The strings must stay valid.
+     *
+     * @param id client id, identifies the device at the broker.
+     * @param user user name, nullptr for an anonymous connection.
+     * @param pass password.
+     */
+    void setMqtt(const char* id, const char* user, const char* pass);
+
+    /**
+     * Adds a topic to subscribe to after every (re)connect. The string must stay valid.
+     *
+     * @param topic topic filter, may contain wildcards.
+     * @param qos maximum QoS of the messages, 0 or 1.
+     * @return false if CONNECTION_MAX_TOPICS topics were already added.
+     */
+    bool subscribe(const char* topic, uint8_t qos = 0);
+
+    /**
+     * Advances the state machine by at most one step. Call from loop().
+     */
+    void update();
+
+    /**
+     * @return true if WiFi and MQTT are connected and all topics are subscribed.
+     */
+    bool connected();
+
+    /**
+     * @return the current state, CONNECTION_*.
+     */
+    uint8_t state();
+
+    /**
+     * @return number of times the broker connection was set up since startup.
+     */
+    uint32_t connects();
+
+  private:
+    PubSubClient& client;
+    const char* ssid;
+    const char* password;
+    const char* mqttId{nullptr};
+    const char* mqttUser{nullptr};
+    const char* mqttPass{nullptr};
+    const char* topics[CONNECTION_MAX_TOPICS];
+    uint8_t topicQos[CONNECTION_MAX_TOPICS];
+    uint8_t topicCount{0};
+    uint16_t subscribeId{0}; // Message id of the SUBSCRIBE waiting for its SUBACK
+    uint8_t connectionState{CONNECTION_WIFI_START};
+    uint8_t retryState{CONNECTION_WIFI_START}; // State to return to after the backoff
+    unsigned long stateTime{0};                // millis() when the state was entered
+    unsigned long backoff{CONNECTION_BACKOFF_MIN};
+    uint32_t connectCount{0};
+    void enter(uint8_t state);
+    void retry(uint8_t state);
+    void suback(uint16_t msgId, uint8_t* codes, uint8_t count);
+};
@@ -0,0 +1,211 @@
+/** @file
+ * Decodes Domoticz messages straight into a struct, without a JSON document.
+ */
+
+#include <string.h>
+#include "DomoticzDecoder.h"
+
+// Cursor over the payload, every read checks the end
+struct Reader {
+  const uint8_t* p;
+  const uint8_t* end;
+
+  bool more() {
+    return p < end;
+  }
+
+  uint8_t peek() {
+    return p < end ? *p : 0;
+  }
+
+  void skipSpace() {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+  }
+
+  bool expect(uint8_t c) {
+    skipSpace();
+    if (peek() != c) return false;
+    p++;
+    return true;
+  }
+};
+
+// Reads a string after its opening quote, copying at most size - 1 bytes to out when out is set
+static bool readString(Reader& r, char* out, uint16_t size) {
+  uint16_t n = 0;
+  while (r.more()) {
+    uint8_t c = *r.p++;
+    if (c == '"') {
+      if (out) out[n] = 0;
+      return true;
+    }
+    if (c == '\\') {
+      if (!r.more()) return false;
+      c = *r.p++;
+      switch (c) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case 'r': c = '\r'; break;
+        case 'b': c = '\b'; break;
+        case 'f': c = '\f'; break;
+        case 'u': // Not needed for the values that are decoded, keep a placeholder
+          if (r.end - r.p < 4) return false;
+          r.p += 4;
+          c = '?';
+          break;
+      }
+    }
+    if (out && n + 1 < size) out[n++] = c;
+  }
+  return false;
+}
+
+// Reads a number, optionally in quotes, as Domoticz puts numbers in svalue
+static bool readNumber(Reader& r, float& value) {
+  bool quoted = r.peek() == '"';
+  if (quoted) r.p++;
+  bool negative = r.peek() == '-';
+  if (negative) r.p++;
+  const uint8_t* start = r.p;
+  float result = 0;
+  while (r.peek() >= '0' && r.peek() <= '9') result = result * 10 + (*r.p++ - '0');
+  if (r.peek() == '.') {
+    r.p++;
+    float scale = 0.1f;
+    while (r.peek() >= '0' && r.peek() <= '9') {
+      result += (*r.p++ - '0') * scale;
+      scale /= 10;
+    }
+  }
+  if (r.peek() == 'e' || r.peek() == 'E') {
+    r.p++;
+    bool down = r.peek() == '-';
+    if (down || r.peek() == '+') r.p++;
+    int exponent = 0;
+    while (r.peek() >= '0' && r.peek() <= '9') {
+      exponent = exponent * 10 + (*r.p++ - '0');
+      if (exponent > 38) exponent = 38; // A float ends at 3.4e38, this also bounds the loop below
+    }
+    while (exponent-- > 0) result = down ? result / 10 : result * 10;
+  }
+  if (r.p == start) return false;
+  if (quoted && (r.peek() != '"' || !r.more())) return false;
+  if (quoted) r.p++;
+  value = negative ? -result : result;
+  return true;
+}
+
+// Reads a whole number, optionally in quotes, in integer arithmetic: a float only holds 24 bits.
+// Fails on a fraction or an exponent and on a value outside min to max.
+static bool readInteger(Reader& r, int64_t min, int64_t max, int64_t& value) {
+  bool quoted = r.peek() == '"';
+  if (quoted) r.p++;
+  bool negative = r.peek() == '-';
+  if (negative) r.p++;
+  const uint8_t* start = r.p;
+  int64_t result = 0;
+  while (r.peek() >= '0' && r.peek() <= '9') {
+    result = result * 10 + (*r.p++ - '0');
+    if (result > max - min) result = max - min + 1; // Out of range already, stop growing
+  }
+  if (r.p == start || r.peek() == '.' || r.peek() == 'e' || r.peek() == 'E') return false;
+  if (quoted && r.peek() != '"') return false;
+  if (quoted) r.p++;
+  value = negative ? -result : result;
+  return value >= min && value <= max;
+}
+
+// Skips a value of any type
+static bool skipValue(Reader& r, uint8_t nesting) {
+  r.skipSpace();
+  uint8_t c = r.peek();
+  if (c == '"') {
+    r.p++;
+    return readString(r, nullptr, 0);
+  }
+  if (c == '{' || c == '[') {
+    if (nesting == 0) return false;
+    uint8_t close = c == '{' ? '}' : ']';
+    r.p++;
+    if (r.expect(close)) return true;
+    do {
+      if (c == '{' && !(r.expect('"') && readString(r, nullptr, 0) && r.expect(':'))) return false;
+      if (!skipValue(r, nesting - 1)) return false;
+    } while (r.expect(','));
+    return r.expect(close);
+  }
+  // Number, true, false or null
+  const uint8_t* start = r.p;
+  while (r.more() && *r.p != ',' && *r.p != '}' && *r.p != ']' && *r.p != ' ' && *r.p != '\t' && *r.p != '\r' && *r.p != '\n') r.p++;
+  return r.p != start;
+}
+
+// Reads the value of a bound key into its member, a value of the wrong type is skipped
+static bool readField(Reader& r, const DomoticzField& field, uint8_t* target) {
+  r.skipSpace();
+  uint8_t* member = target + field.offset;
+  if (field.type == DOMOTICZ_STRING) {
+    if (r.peek() != '"') return skipValue(r, DOMOTICZ_NESTING_LIMIT);
+    r.p++;
+    return readString(r, (char*)member, field.size);
+  }
+  float value;
+  const uint8_t* start = r.p;
+  if (!readNumber(r, value)) {
+    r.p = start;
+    return skipValue(r, DOMOTICZ_NESTING_LIMIT);
+  }
+  if (field.type == DOMOTICZ_FLOAT) {
+    memcpy(member, &value, sizeof(float));
+    return true;
+  }
+  // A number, read it again as an integer that must fit the member
+  r.p = start;
+  uint8_t bits = field.size * 8;
+  bool isSigned = field.type == DOMOTICZ_INT;
+  int64_t min = isSigned ? -((int64_t)1 << (bits - 1)) : 0;
+  int64_t max = isSigned ? ((int64_t)1 << (bits - 1)) - 1 : ((int64_t)1 << bits) - 1;
+  int64_t n;
+  if (!readInteger(r, min, max, n)) return false;
+  if (field.size == 1) *member = (uint8_t)n;
+  else if (field.size == 2) {
+    uint16_t n16 = (uint16_t)n;
+    memcpy(member, &n16, 2);
+  } else {
+    uint32_t n32 = (uint32_t)n;
+    memcpy(member, &n32, 4);
+  }
+  return true;
+}
+
+bool domoticzDecode(const uint8_t* json, uint32_t length, void* target, const DomoticzField* fields, uint8_t count) {
+  Reader r{json, json + length};
+  if (!r.expect('{')) return false;
+  if (r.expect('}')) return true;
+  do {
+    if (!r.expect('"')) return false;
+    // Hash the key while reading it
+    uint32_t hash = 2166136261UL;
+    const uint8_t* key = r.p;
+    while (r.more() && *r.p != '"') {
+      if (*r.p == '\\') { // An escaped character is hashed as written, no bound key has one
+        hash = (hash ^ *r.p++) * 16777619UL;
+        if (!r.more()) return false;
+      }
+      hash = (hash ^ *r.p++) * 16777619UL;
+    }
+    if (!r.more()) return false;
+    uint32_t keyLength = r.p - key;
+    r.p++;
+    if (!r.expect(':')) return false;
+    const DomoticzField* field = nullptr;
+    for (uint8_t i = 0; i < count; i++) {
+      if (fields[i].hash == hash && fields[i].keyLength == keyLength && memcmp(fields[i].key, key, keyLength) == 0) {
+        field = &fields[i];
+        break;
+      }
+    }
+    if (field ? !readField(r, *field, (uint8_t*)target) : !skipValue(r, DOMOTICZ_NESTING_LIMIT)) return false;
+  } while (r.expect(','));
+  return r.expect('}');
+}
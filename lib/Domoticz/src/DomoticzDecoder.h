@@ -0,0 +1,99 @@
+/** @file
+ * Decodes Domoticz messages straight into a struct, without a JSON document.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+/**
+ * Kinds of struct members a JSON key can be bound to.
+ *
+ * DOMOTICZ_INT: signed integer of 1, 2 or 4 bytes. A number in quotes, as Domoticz sends svalue1, is
+ *               accepted too. A number with a fraction or an exponent, or one that does not fit the
+ *               member, makes the message invalid rather than being cut to fit.
+ * DOMOTICZ_FLOAT: float, also accepted in quotes.
+ * DOMOTICZ_STRING: char array, the string is truncated to fit and always zero terminated.
+ * DOMOTICZ_UINT: unsigned integer of 1, 2 or 4 bytes, otherwise like DOMOTICZ_INT.
+ */
+#define DOMOTICZ_INT    0
+#define DOMOTICZ_FLOAT  1
+#define DOMOTICZ_STRING 2
+#define DOMOTICZ_UINT   3
+
+/**
+ * Objects and arrays nested deeper than this in a skipped value make the message invalid.
+ */
+#define DOMOTICZ_NESTING_LIMIT 10
+
+/**
+ * Binds one JSON key to a struct member. Build them with DOMOTICZ_FIELD().
+ */
+struct DomoticzField {
+  const char* key;   // Compared after the hash matched, a key of another message can have the same hash
+  uint32_t hash;     // domoticzHash() of the key
+  uint8_t keyLength;
+  uint8_t type;      // DOMOTICZ_INT, DOMOTICZ_UINT, DOMOTICZ_FLOAT or DOMOTICZ_STRING
+  uint16_t offset;   // Of the member in the struct
+  uint16_t size;     // Of the member
+};
+
+/**
+ * FNV-1a hash of a key, evaluated at compile time for the field lists.
+ */
+constexpr uint32_t domoticzHash(const char* key, uint32_t hash = 2166136261UL) {
+  return *key ? domoticzHash(key + 1, (hash ^ (uint8_t)*key) * 16777619UL) : hash;
+}
+
+template <typename T>
+constexpr uint8_t domoticzTypeOf() {
+  static_assert(std::is_integral<T>::value || std::is_floating_point<T>::value || std::is_array<T>::value,
+                "a field must be an integer, a float or a char array");
+  return std::is_floating_point<T>::value ? DOMOTICZ_FLOAT
+         : std::is_array<T>::value        ? DOMOTICZ_STRING
+         : std::is_unsigned<T>::value     ? DOMOTICZ_UINT
+                                          : DOMOTICZ_INT;
+}
+
+/**
+ * Field list entry that binds the JSON key to member of the struct type.
+ */
+#define DOMOTICZ_FIELD(type, key, member) \
+  DomoticzField{key, domoticzHash(key), sizeof(key) - 1, domoticzTypeOf<decltype(type::member)>(), offsetof(type, member), sizeof(type::member)}
+
+/**
+ * Decodes a JSON object in one pass. The values of the keys in the field list are stored in the
+ * target, all other keys are skipped whatever their value. Members whose key is missing keep their
+ * value. Nothing is allocated.
+ *
+ * @return false if the payload is not a valid JSON object or an integer does not fit its member,
+ * for instance an idx above 65535. The target may then be partly written.
+ */
+bool domoticzDecode(const uint8_t* json, uint32_t length, void* target, const DomoticzField* fields, uint8_t count);
+
+template <typename T, size_t N>
+bool domoticzDecode(const uint8_t* json, uint32_t length, T& target, const DomoticzField (&fields)[N]) {
+  static_assert(std::is_trivially_copyable<T>::value, "the target must be a plain struct");
+  return domoticzDecode(json, length, &target, fields, N);
+}
+
+/**
+ * The fields of a message on domoticz/out that this node uses.
+ */
+struct DomoticzMessage {
+  uint16_t idx;
+  int32_t nvalue;
+  float svalue;
+  float svalue1;
+  char command[24];
+};
+
+constexpr DomoticzField domoticzMessageFields[]{
+  DOMOTICZ_FIELD(DomoticzMessage, "idx", idx),
+  DOMOTICZ_FIELD(DomoticzMessage, "nvalue", nvalue),
+  DOMOTICZ_FIELD(DomoticzMessage, "svalue", svalue),
+  DOMOTICZ_FIELD(DomoticzMessage, "svalue1", svalue1),
+  DOMOTICZ_FIELD(DomoticzMessage, "command", command),
+};
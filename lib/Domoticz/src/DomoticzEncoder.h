@@ -0,0 +1,264 @@
+/** @file
+ * Writes Domoticz commands for domoticz/in without a JSON document, String or heap.
+ *
+ * The commands are templates on the writer, anything with write(const uint8_t*, size_t) such as
+ * PubSubClient. A command is written twice by domoticzPublish(): once to a DomoticzCounter for
+ * the exact length, then through beginPublish()/write()/endPublish() to the socket in chunks of
+ * DOMOTICZ_CHUNK bytes from the stack.
+ * See https://www.domoticz.com/wiki/MQTT#Update_devices.2Fsensors for the commands.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Bytes domoticzPublish() collects on the stack before writing them to the client. Every write
+ * to the client can be a TCP segment of its own, the pieces of a command are a few bytes each.
+ */
+#ifndef DOMOTICZ_CHUNK
+#define DOMOTICZ_CHUNK 64
+#endif
+
+/**
+ * Counts the bytes of a command instead of writing them.
+ */
+struct DomoticzCounter {
+  size_t length{0};
+
+  size_t write(const uint8_t*, size_t size) {
+    length += size;
+    return size;
+  }
+};
+
+/**
+ * Writes a command into a buffer, for instance for the offline spool. The text is always zero
+ * terminated. A command that does not fit is cut off and overflow is set: it is no valid JSON
+ * and must not be sent.
+ */
+struct DomoticzBuffer {
+  char* buffer;
+  size_t size;
+  size_t length{0};
+  bool overflow{false};
+
+  DomoticzBuffer(char* buffer, size_t size) : buffer(buffer), size(size) {
+    if (size) buffer[0] = 0;
+  }
+
+  size_t write(const uint8_t* data, size_t count) {
+    if (length + count >= size) {
+      overflow = true;
+      count = size ? size - 1 - length : 0;
+    }
+    memcpy(buffer + length, data, count);
+    length += count;
+    if (size) buffer[length] = 0;
+    return count;
+  }
+};
+
+/**
+ * Collects the writes to a client into chunks of DOMOTICZ_CHUNK bytes.
+ */
+template <typename Writer>
+struct DomoticzChunks {
+  Writer& out;
+  uint8_t chunk[DOMOTICZ_CHUNK];
+  uint8_t length{0};
+  bool failed{false};
+
+  DomoticzChunks(Writer& out) : out(out) {}
+
+  size_t write(const uint8_t* data, size_t count) {
+    for (size_t done = 0; done < count;) {
+      if (length == sizeof(chunk)) flush();
+      size_t part = count - done < sizeof(chunk) - length ? count - done : sizeof(chunk) - length;
+      memcpy(chunk + length, data + done, part);
+      length += part;
+      done += part;
+    }
+    return count;
+  }
+
+  bool flush() {
+    if (length && out.write(chunk, length) != length) failed = true;
+    length = 0;
+    return !failed;
+  }
+};
+
+/**
+ * Writes the members of one JSON object.
+ */
+template <typename Writer>
+class DomoticzJson {
+  public:
+    DomoticzJson(Writer& out, const char* command) : out(out) {
+      text("{\"command\":\"");
+      text(command);
+      text("\"");
+    }
+
+    ~DomoticzJson() {
+      text("}");
+    }
+
+    void field(const char* key, const char* value) {
+      name(key);
+      string(value);
+    }
+
+    void field(const char* key, int32_t value) {
+      name(key);
+      number(value);
+    }
+
+    void field(const char* key, bool value) {
+      name(key);
+      text(value ? "true" : "false");
+    }
+
+    // String of numbers joined by ';', as in the svalue of udevice
+    void field(const char* key, const float* values, uint8_t count) {
+      name(key);
+      text("\"");
+      for (uint8_t i = 0; i < count; i++) {
+        if (i) text(";");
+        decimal(values[i]);
+      }
+      text("\"");
+    }
+
+  private:
+    Writer& out;
+
+    void text(const char* s) {
+      out.write((const uint8_t*)s, strlen(s));
+    }
+
+    void name(const char* key) {
+      text(",\"");
+      text(key);
+      text("\":");
+    }
+
+    void string(const char* s) {
+      text("\"");
+      const char* run = s; // Written in runs between the characters that need escaping
+      for (; *s; s++) {
+        uint8_t c = *s;
+        if (c != '"' && c != '\\' && c >= 0x20) continue;
+        out.write((const uint8_t*)run, s - run);
+        text(c == '"' ? "\\\"" : c == '\\' ? "\\\\" : c == '\n' ? "\\n" : c == '\t' ? "\\t" : c == '\r' ? "\\r" : " ");
+        run = s + 1;
+      }
+      out.write((const uint8_t*)run, s - run);
+      text("\"");
+    }
+
+    void number(int32_t value) {
+      char digits[12];
+      uint8_t pos = sizeof(digits);
+      uint32_t n = value < 0 ? 0 - (uint32_t)value : value;
+      do {
+        digits[--pos] = '0' + n % 10;
+        n /= 10;
+      } while (n);
+      if (value < 0) digits[--pos] = '-';
+      out.write((const uint8_t*)digits + pos, sizeof(digits) - pos);
+    }
+
+    // Up to two decimals, without trailing zeros
+    void decimal(float value) {
+      int32_t hundredths = value < 0 ? (int32_t)(value * 100 - 0.5f) : (int32_t)(value * 100 + 0.5f);
+      if (hundredths < 0 && hundredths / 100 == 0) text("-");
+      number(hundredths / 100);
+      uint8_t fraction = hundredths < 0 ? -hundredths % 100 : hundredths % 100;
+      if (fraction == 0) return;
+      char digits[]{'.', (char)('0' + fraction / 10), (char)('0' + fraction % 10), 0};
+      if (digits[2] == '0') digits[2] = 0;
+      text(digits);
+    }
+};
+
+/**
+ * Switches a light: switchcmd "On", "Off" or "Toggle".
+ */
+template <typename Writer>
+void domoticzSwitchlight(Writer& out, uint16_t idx, const char* switchcmd) {
+  DomoticzJson<Writer> json(out, "switchlight");
+  json.field("idx", (int32_t)idx);
+  json.field("switchcmd", switchcmd);
+}
+
+/**
+ * Sets the level of a dimmer, 0 to 100.
+ */
+template <typename Writer>
+void domoticzSwitchlight(Writer& out, uint16_t idx, uint8_t level) {
+  DomoticzJson<Writer> json(out, "switchlight");
+  json.field("idx", (int32_t)idx);
+  json.field("switchcmd", "Set Level");
+  json.field("level", (int32_t)level);
+}
+
+/**
+ * Updates a device or sensor with an nvalue and the values of its svalue.
+ */
+template <typename Writer>
+void domoticzUdevice(Writer& out, uint16_t idx, int32_t nvalue, const float* svalues, uint8_t count) {
+  DomoticzJson<Writer> json(out, "udevice");
+  json.field("idx", (int32_t)idx);
+  json.field("nvalue", nvalue);
+  json.field("svalue", svalues, count);
+}
+
+/**
+ * Sets the colour and brightness of an RGB light.
+ *
+ * @param hue 0 to 360.
+ * @param brightness 0 to 100.
+ * @param white true for the white channel instead of the colour.
+ */
+template <typename Writer>
+void domoticzSetcolbrightnessvalue(Writer& out, uint16_t idx, uint16_t hue, uint8_t brightness, bool white) {
+  DomoticzJson<Writer> json(out, "setcolbrightnessvalue");
+  json.field("idx", (int32_t)idx);
+  json.field("hue", (int32_t)hue);
+  json.field("brightness", (int32_t)brightness);
+  json.field("iswhite", white);
+}
+
+/**
+ * Adds a line to the Domoticz log.
+ */
+template <typename Writer>
+void domoticzAddlogmessage(Writer& out, const char* message) {
+  DomoticzJson<Writer> json(out, "addlogmessage");
+  json.field("message", message);
+}
+
+/**
+ * Publishes the command written by encode(writer), which is called twice: to count the bytes and
+ * to write them to the client. Both calls must write exactly the same bytes, otherwise the length
+ * in the MQTT header is wrong and the connection to the broker is corrupted. Read values that an
+ * interrupt can change, like the state of a dimmer, into locals first and capture those by value:
+ *
+ *   uint8_t level = dimmer.target();
+ *   domoticzPublish(client, "domoticz/in", [level](auto& out) { domoticzSwitchlight(out, 1385, level); });
+ *
+ * @return false if the client could not publish.
+ */
+template <typename Client, typename Encode>
+bool domoticzPublish(Client& client, const char* topic, Encode encode) {
+  DomoticzCounter counter;
+  encode(counter);
+  if (!client.beginPublish(topic, counter.length, false)) return false;
+  DomoticzChunks<Client> chunks(client);
+  encode(chunks);
+  return chunks.flush() && client.endPublish();
+}
@@ -0,0 +1,58 @@
+/** @file
+ * Finds the idx of a Domoticz message without parsing the JSON.
+ */
+
+#include <string.h>
+#include "DomoticzFilter.h"
+
+// Bit 7 of every byte of the word that is a quote. A borrow can only flag a byte above a real
+// quote, so the lowest flag is always right.
+static inline uint32_t quoteBytes(uint32_t word) {
+  uint32_t x = word ^ 0x22222222UL;
+  return (x - 0x01010101UL) & ~x & 0x80808080UL;
+}
+
+// First quote from p, or end
+static const uint8_t* findQuote(const uint8_t* p, const uint8_t* end) {
+  while (p < end && ((uintptr_t)p & 3)) { // Up to a word boundary, the ESP8266 has no unaligned loads
+    if (*p == '"') return p;
+    p++;
+  }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (end - p >= 4) {
+    uint32_t word;
+    memcpy(&word, p, 4); // One aligned load
+    uint32_t quotes = quoteBytes(word);
+    if (quotes) return p + (__builtin_ctz(quotes) >> 3);
+    p += 4;
+  }
+#endif
+  while (p < end && *p != '"') p++;
+  return p;
+}
+
+static const uint8_t* skipSpace(const uint8_t* p, const uint8_t* end) {
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+  return p;
+}
+
+bool domoticzPeekIdx(const uint8_t* payload, uint32_t length, uint16_t& idx) {
+  const uint8_t* end = payload + length;
+  const uint8_t* p = payload;
+  while ((p = findQuote(p, end)) < end) {
+    if (end - p < 5 || memcmp(p, "\"idx\"", 5) != 0) {
+      p++;
+      continue;
+    }
+    p = skipSpace(p + 5, end);
+    if (p == end || *p != ':') continue; // The text "idx" as a value
+    p = skipSpace(p + 1, end);
+    uint32_t value = 0;
+    const uint8_t* digits = p;
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 6) value = value * 10 + (*p++ - '0');
+    if (p == digits || value > 0xFFFF) return false;
+    idx = value;
+    return true;
+  }
+  return false;
+}
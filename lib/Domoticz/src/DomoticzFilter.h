@@ -0,0 +1,21 @@
+/** @file
+ * Finds the idx of a Domoticz message without parsing the JSON.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Looks for the "idx" key in a raw message on domoticz/out and reads its integer value.
+ *
+ * The payload is scanned a 32 bit word at a time for quotes, only the bytes around a quote are
+ * looked at. This is much cheaper than building a JSON document, so messages for devices of other
+ * nodes can be dropped right away. A message without a usable idx must still be parsed in full.
+ *
+ * @param payload message, does not have to be zero terminated.
+ * @param length bytes in the message.
+ * @param idx set to the value of the first "idx" key.
+ * @return false if there is no "idx" key followed by an integer from 0 to 65535.
+ */
+bool domoticzPeekIdx(const uint8_t* payload, uint32_t length, uint16_t& idx);
@@ -0,0 +1,94 @@
+/** @file
+ * Hands the messages on domoticz/out to the devices of this node, looked up by idx.
+ */
+
+#include "DomoticzRouter.h"
+#include "DomoticzFilter.h"
+
+// Lamp value of svalue1, which comes from the broker as any number. Converting a float outside
+// 0 to 255 or NaN to uint8_t is undefined, so it is clamped first. NaN fails every comparison
+static uint8_t lampValue(float value) {
+  if (!(value > 0)) return 0;
+  if (value >= 100) return 100;
+  return (uint8_t)value;
+}
+
+bool DomoticzRouter::addDimmer(uint16_t idx, Dimmer& dimmer) {
+  Route route{idx, DOMOTICZ_DIMMER, {}};
+  route.dimmer = &dimmer;
+  return add(route);
+}
+
+bool DomoticzRouter::addSwitch(uint16_t idx, DomoticzSwitchHandler handler) {
+  Route route{idx, DOMOTICZ_SWITCH, {}};
+  route.onOff = handler;
+  return add(route);
+}
+
+bool DomoticzRouter::addScene(uint16_t idx, DomoticzSwitchHandler handler) {
+  Route route{idx, DOMOTICZ_SCENE, {}};
+  route.onOff = handler;
+  return add(route);
+}
+
+bool DomoticzRouter::addSensor(uint16_t idx, DomoticzSensorHandler handler) {
+  Route route{idx, DOMOTICZ_SENSOR, {}};
+  route.sensor = handler;
+  return add(route);
+}
+
+bool DomoticzRouter::has(uint16_t idx) {
+  return find(idx) != nullptr;
+}
+
+bool DomoticzRouter::dispatch(const uint8_t* payload, uint32_t length) {
+  uint16_t idx;
+  if (domoticzPeekIdx(payload, length, idx) && !find(idx)) return false; // Another node, skip the decoder
+  DomoticzMessage message{};
+  if (!domoticzDecode(payload, length, message, domoticzMessageFields)) return false;
+  const Route* route = find(message.idx);
+  if (!route) return false;
+  switch (route->type) {
+    case DOMOTICZ_DIMMER:
+      if (message.nvalue) route->dimmer->post(lampValue(message.svalue1)); // Applied at the next zero crossing
+      else route->dimmer->postOff();
+      break;
+    case DOMOTICZ_SWITCH:
+    case DOMOTICZ_SCENE:
+      route->onOff(message.nvalue != 0);
+      break;
+    case DOMOTICZ_SENSOR:
+      route->sensor(message);
+      break;
+  }
+  return true;
+}
+
+uint8_t DomoticzRouter::size() {
+  return count;
+}
+
+// Inserts the route at its place in the sorted table, the table is built once at startup
+bool DomoticzRouter::add(const Route& route) {
+  if (count == DOMOTICZ_MAX_DEVICES || find(route.idx)) return false;
+  uint8_t i = count;
+  while (i > 0 && routes[i-1].idx > route.idx) {
+    routes[i] = routes[i-1];
+    i--;
+  }
+  routes[i] = route;
+  count++;
+  return true;
+}
+
+// Binary search, 6 steps at most for DOMOTICZ_MAX_DEVICES 32
+const DomoticzRouter::Route* DomoticzRouter::find(uint16_t idx) {
+  uint8_t low = 0;
+  uint8_t high = count;
+  while (low < high) {
+    uint8_t middle = (low + high) / 2;
+    if (routes[middle].idx < idx) low = middle + 1;
+    else high = middle;
+  }
+  return low < count && routes[low].idx == idx ? &routes[low] : nullptr;
+}
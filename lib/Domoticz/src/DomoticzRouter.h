@@ -0,0 +1,83 @@
+/** @file
+ * Hands the messages on domoticz/out to the devices of this node, looked up by idx.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "Dimmer.h"
+#include "DomoticzDecoder.h"
+
+/**
+ * Most devices one router holds, 8 bytes of RAM each.
+ */
+#ifndef DOMOTICZ_MAX_DEVICES
+#define DOMOTICZ_MAX_DEVICES 32
+#endif
+
+/**
+ * Kinds of devices a message can be routed to.
+ *
+ * DOMOTICZ_DIMMER: a dimmer channel, nvalue 0 turns it off, otherwise it is set to svalue1.
+ * DOMOTICZ_SWITCH: on/off handler, on when nvalue is not 0.
+ * DOMOTICZ_SCENE: on/off handler of a scene or group. Scenes have their own idx numbers in
+ *                 Domoticz, they must not be the same as those of the devices on this node.
+ * DOMOTICZ_SENSOR: handler that gets the whole decoded message.
+ */
+#define DOMOTICZ_DIMMER 0
+#define DOMOTICZ_SWITCH 1
+#define DOMOTICZ_SCENE  2
+#define DOMOTICZ_SENSOR 3
+
+typedef void (*DomoticzSwitchHandler)(bool on);
+typedef void (*DomoticzSensorHandler)(const DomoticzMessage& message);
+
+/**
+ * Table of the devices of this node, sorted by idx. Build it in setup(), every message is then
+ * dropped, decoded or routed with a binary search instead of a switch on the idx.
+ */
+class DomoticzRouter {
+  public:
+    /**
+     * Adds a device. The add functions fail when the table is full or the idx is taken.
+     */
+    bool addDimmer(uint16_t idx, Dimmer& dimmer);
+    bool addSwitch(uint16_t idx, DomoticzSwitchHandler handler);
+    bool addScene(uint16_t idx, DomoticzSwitchHandler handler);
+    bool addSensor(uint16_t idx, DomoticzSensorHandler handler);
+
+    /**
+     * @return true if a device with this idx has been added.
+     */
+    bool has(uint16_t idx);
+
+    /**
+     * Routes a message on domoticz/out. Messages for devices of other nodes are dropped by
+     * domoticzPeekIdx() before they are decoded.
+     *
+     * @param payload message, does not have to be zero terminated.
+     * @param length bytes in the message.
+     * @return true if the message was handed to a device.
+     */
+    bool dispatch(const uint8_t* payload, uint32_t length);
+
+    /**
+     * @return number of devices added.
+     */
+    uint8_t size();
+
+  private:
+    struct Route {
+      uint16_t idx;
+      uint8_t type; // DOMOTICZ_DIMMER, DOMOTICZ_SWITCH, DOMOTICZ_SCENE or DOMOTICZ_SENSOR
+      union {
+        Dimmer* dimmer;
+        DomoticzSwitchHandler onOff;
+        DomoticzSensorHandler sensor;
+      };
+    };
+    Route routes[DOMOTICZ_MAX_DEVICES];
+    uint8_t count{0};
+    bool add(const Route& route);
+    const Route* find(uint16_t idx);
+};
@@ -4,79 +4,40 @@
 // for example : {"command": "switchlight", "idx": 2450, "switchcmd": "On" }
 
 Json::Json() {}
-/*
-String Json::switchlight(bool cmd)
-{
-    String json_tekst;
-    StaticJsonDocument<1500> jsonBuffer;
-    JsonObject root = jsonBuffer.createNestedObject();
-    root["command"] = "switchlight";
-    root["idx"] = idx;
-    root["switchcmd"] = cmd?"On":"Off";
-    serializeJson(root, json_tekst);
-    return json_tekst;
-}
 
-String Json::udevice(uint16_t idx, const float nvalue, const std::vector<float>* svalue) {
-    String json_tekst;
-    StaticJsonDocument<1500> jsonBuffer;
-    JsonObject root = jsonBuffer.createNestedObject();
-    root["command"] = "udevice";
-    root["idx"] = idx;
-    root["nvalue"] = nvalue;
-    String temp = String(svalue->at(0));
-    for (uint8_t x = 1; x < svalue->size(); x++) {
-        temp += ";";
-        temp += svalue->at(x);
-        }
-    root["svalue"] = temp;
-        serializeJson(root, json_tekst);
-    return json_tekst;
-}
-*/
 bool Json::readJson(String my_string) {
-    return readJson(my_string.c_str());
+    return readJson((const uint8_t *)my_string.c_str(), my_string.length());
 }
 
 bool Json::readJson(unsigned char *my_string) {
-    idx = 0;
-    nvalue = 0;
-    svalue = 0;
-    command = "";
-    StaticJsonDocument<JSON_OBJECT_SIZE(20)> jsonBuffer;
-    DeserializationError err = deserializeJson(jsonBuffer, my_string);
-    if (err) {
-        Serial.print("json parseObject() failed wih code ");
-        Serial.println(err.c_str());
+    return readJson(my_string, strlen((const char *)my_string));
+}
+
+bool Json::readJson(const uint8_t *payload, unsigned int length) {
+    message = DomoticzMessage{};
+    if (!domoticzDecode(payload, length, message, domoticzMessageFields)) {
+        Serial.println("json message invalid");
         return false;
     }
-    if (jsonBuffer.containsKey("command")) { 
-        const char* Command = jsonBuffer["command"];
-        command = String(Command);
-    }
-    if (jsonBuffer.containsKey("idx")) idx = (uint16_t)jsonBuffer["idx"];
-    if (jsonBuffer.containsKey("nvalue")) nvalue = (float)jsonBuffer["nvalue"];
-    if (jsonBuffer.containsKey("svalue")) svalue = (float)jsonBuffer["svalue"];
-    if (jsonBuffer.containsKey("svalue1")) svalue1 = (float)jsonBuffer["svalue1"];
     return true;
 }
 
 float Json::getnvalue() {
-    return nvalue;
+    return message.nvalue;
 }
 
 float Json::getsvalue() {
-    return svalue;
+    return message.svalue;
 }
 
 float Json::getsvalue1() {
-    return svalue1;
+    return message.svalue1;
 }
 
 uint16_t Json::getidx() {
-    return idx;
+    return message.idx;
 }
 
-String Json::getcommand() {
-    return command;
+const char *Json::getcommand() {
+    return message.command;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include "DomoticzDecoder.h"
 //#include <vector>
 
 static const int BUFFERSIZE{350}; // json default buffer size
@@ -9,28 +10,21 @@ static const int BUFFERSIZE{350}; // json default buffer size
 class Json {
   public:
     Json();
-    String addlogmessage();
-    String switchlight(const bool);
+    // Commands to Domoticz are written by DomoticzEncoder.h
     String getdeviceinfo();
     String getsceneinfo();
     String sendnotification();
     String setuservariable();
-    String setcolbrightnessvalue();
-    String switchlight();
     String switchscene();
-    String udevice(const uint16_t, const float, const std::vector<float>*);
     bool readJson(const String my_string);
     bool readJson(unsigned char *my_string);
+    bool readJson(const uint8_t *payload, unsigned int length);
     float getnvalue();
     float getsvalue();
     float getsvalue1();
     uint16_t getidx();
-    String getcommand();
+    const char *getcommand();
 
   private : 
-    uint16_t idx;
-    float nvalue;
-    float svalue;
-    float svalue1;
-    String command;
+    DomoticzMessage message; // Decoded in one pass, without a JSON document or String
 };
\ No newline at end of file
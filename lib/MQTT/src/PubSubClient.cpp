@@ -8,13 +8,30 @@
 #include "PubSubClient.h"
 #include "Arduino.h"
 
+// Stages of the incremental packet reader
+#define MQTT_READ_HEADER 0 // Waiting for the fixed header byte
+#define MQTT_READ_LENGTH 1 // Reading the remaining length
+#define MQTT_READ_BODY   2 // Reading the variable header and payload
+
+// Bytes MQTT 5 adds for the properties: their length, and a topic alias in a PUBLISH
+#if MQTT_VERSION == MQTT_VERSION_5
+#define MQTT_PROPERTY_BYTES 1
+#define MQTT_PUBLISH_PROPERTY_BYTES 4
+#else
+#define MQTT_PROPERTY_BYTES 0
+#define MQTT_PUBLISH_PROPERTY_BYTES 0
+#endif
+
+// Up to this many filters without wildcards are compared with the topic by strcmp() alone. Summing
+// the topic first to tell the filters apart only pays off when there are more.
+#define MQTT_LITERAL_SCAN 8
+
 PubSubClient::PubSubClient() {
     this->_state = MQTT_DISCONNECTED;
     this->_client = NULL;
     this->stream = NULL;
     setCallback(NULL);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -23,8 +40,7 @@ PubSubClient::PubSubClient(Client& client) {
     this->_state = MQTT_DISCONNECTED;
     setClient(client);
     this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -34,8 +50,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client) {
     setServer(addr, port);
     setClient(client);
     this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -44,8 +59,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, Client& client, Stream
     setServer(addr,port);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -55,8 +69,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
     setCallback(callback);
     setClient(client);
     this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -66,8 +79,7 @@ PubSubClient::PubSubClient(IPAddress addr, uint16_t port, MQTT_CALLBACK_SIGNATUR
     setCallback(callback);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -77,8 +89,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client) {
     setServer(ip, port);
     setClient(client);
     this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -87,8 +98,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, Client& client, Stream& s
     setServer(ip,port);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -98,8 +108,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
     setCallback(callback);
     setClient(client);
     this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -109,8 +118,7 @@ PubSubClient::PubSubClient(uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE,
     setCallback(callback);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -120,8 +128,7 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client) {
     setServer(domain,port);
     setClient(client);
     this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -130,8 +137,7 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, Client& client, St
     setServer(domain,port);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -141,8 +147,7 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
     setCallback(callback);
     setClient(client);
     this->stream = NULL;
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
@@ -152,14 +157,18 @@ PubSubClient::PubSubClient(const char* domain, uint16_t port, MQTT_CALLBACK_SIGN
     setCallback(callback);
     setClient(client);
     setStream(stream);
-    this->bufferSize = 0;
-    setBufferSize(MQTT_MAX_PACKET_SIZE);
+    setBufferSize(MQTT_MAX_PACKET_SIZE, MQTT_MAX_TX_SIZE);
     setKeepAlive(MQTT_KEEPALIVE);
     setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 }
 
 PubSubClient::~PubSubClient() {
-  free(this->buffer);
+  if (this->rxOwned) {
+    free(this->rxBuffer);
+  }
+  if (this->txOwned) {
+    free(this->txBuffer);
+  }
 }
 
 boolean PubSubClient::connect(const char *id) {
@@ -179,6 +188,27 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 }
 
 boolean PubSubClient::connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    if (!connectAsync(id,user,pass,willTopic,willQos,willRetain,willMessage,cleanSession)) {
+        return false;
+    }
+    while (poll() == MQTT_CONNECTING) {
+        yield();
+    }
+    return this->_state == MQTT_CONNECTED;
+}
+
+boolean PubSubClient::connectAsync(const char *id) {
+    return connectAsync(id,NULL,NULL,0,0,0,0,1);
+}
+
+boolean PubSubClient::connectAsync(const char *id, const char *user, const char *pass) {
+    return connectAsync(id,user,pass,0,0,0,0,1);
+}
+
+boolean PubSubClient::connectAsync(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession) {
+    if (this->_state == MQTT_CONNECTING) {
+        return true;
+    }
     if (!connected()) {
         int result = 0;
 
@@ -194,7 +224,9 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
         }
 
         if (result == 1) {
-            nextMsgId = 1;
+            if (this->inflightCount == 0) {
+                nextMsgId = 1; // Otherwise keep the ids of the messages to send again unique
+            }
             // Leave room in the buffer for header and variable length field
             uint16_t length = MQTT_MAX_HEADER_SIZE;
             unsigned int j;
@@ -202,12 +234,12 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
 #if MQTT_VERSION == MQTT_VERSION_3_1
             uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
+#elif MQTT_VERSION == MQTT_VERSION_3_1_1 || MQTT_VERSION == MQTT_VERSION_5
             uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
 #define MQTT_HEADER_VERSION_LENGTH 7
 #endif
             for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                this->buffer[length++] = d[j];
+                this->txBuffer[length++] = d[j];
             }
 
             uint8_t v;
@@ -227,55 +259,68 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
                     v = v|(0x80>>1);
                 }
             }
-            this->buffer[length++] = v;
-
-            this->buffer[length++] = ((this->keepAlive) >> 8);
-            this->buffer[length++] = ((this->keepAlive) & 0xFF);
+            this->txBuffer[length++] = v;
+
+            this->txBuffer[length++] = ((this->keepAlive) >> 8);
+            this->txBuffer[length++] = ((this->keepAlive) & 0xFF);
+
+#if MQTT_VERSION == MQTT_VERSION_5
+            // Limits of this client: receive maximum, maximum packet size and topic alias maximum.
+            // An incoming QoS 1 message is acknowledged as soon as its handler returns, so only one
+            // is held at a time. MQTT_MAX_INFLIGHT is the window of outgoing messages, not this one
+            uint32_t maxPacket = this->messageChunk ? 0xFFFFFFF : this->rxBufferSize;
+            uint8_t p[] = {0, 0x21, 0, 1,
+                           0x27, (uint8_t)(maxPacket >> 24), (uint8_t)(maxPacket >> 16), (uint8_t)(maxPacket >> 8), (uint8_t)maxPacket,
+                           0x22, 0, MQTT_MAX_TOPIC_ALIASES};
+            if (length+sizeof(p) > this->txBufferSize) {
+                _client->stop();
+                return false;
+            }
+            p[0] = sizeof(p)-1;
+            memcpy(this->txBuffer+length, p, sizeof(p));
+            length += sizeof(p);
+            this->aliasOutMax = 0; // Until the CONNACK allows aliases
+            this->aliasOutCount = 0;
+            this->serverReceiveMax = 0xFFFF;
+            memset(this->aliasIn, 0, sizeof(this->aliasIn));
+#endif
 
             CHECK_STRING_LENGTH(length,id)
-            length = writeString(id,this->buffer,length);
+            length = writeString(id,this->txBuffer,length);
             if (willTopic) {
+#if MQTT_VERSION == MQTT_VERSION_5
+                this->txBuffer[length++] = 0; // No will properties
+#endif
                 CHECK_STRING_LENGTH(length,willTopic)
-                length = writeString(willTopic,this->buffer,length);
+                length = writeString(willTopic,this->txBuffer,length);
                 CHECK_STRING_LENGTH(length,willMessage)
-                length = writeString(willMessage,this->buffer,length);
+                length = writeString(willMessage,this->txBuffer,length);
             }
 
             if(user != NULL) {
                 CHECK_STRING_LENGTH(length,user)
-                length = writeString(user,this->buffer,length);
+                length = writeString(user,this->txBuffer,length);
                 if(pass != NULL) {
                     CHECK_STRING_LENGTH(length,pass)
-                    length = writeString(pass,this->buffer,length);
+                    length = writeString(pass,this->txBuffer,length);
                 }
             }
 
-            write(MQTTCONNECT,this->buffer,length-MQTT_MAX_HEADER_SIZE);
-
-            lastInActivity = lastOutActivity = millis();
-
-            while (!_client->available()) {
-                unsigned long t = millis();
-                if (t-lastInActivity >= ((int32_t) this->socketTimeout*1000UL)) {
-                    _state = MQTT_CONNECTION_TIMEOUT;
-                    _client->stop();
-                    return false;
-                }
+            this->stageUsed = 0; // Nothing of a previous connection is sent on this one
+            boolean sent = write(MQTTCONNECT,this->txBuffer,length-MQTT_MAX_HEADER_SIZE);
+            if (this->stageUsed > 0) {
+                sent = sendStaged() && sent;
             }
-            uint8_t llen;
-            uint32_t len = readPacket(&llen);
-
-            if (len == 4) {
-                if (buffer[3] == 0) {
-                    lastInActivity = millis();
-                    pingOutstanding = false;
-                    _state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    _state = buffer[3];
-                }
+            if (!sent) {
+                _state = MQTT_CONNECT_FAILED;
+                _client->stop();
+                return false;
             }
-            _client->stop();
+
+            lastInActivity = lastOutActivity = millis();
+            this->readStage = MQTT_READ_HEADER; // Start reading at a packet boundary
+            _state = MQTT_CONNECTING; // poll() waits for the CONNACK
+            return true;
         } else {
             _state = MQTT_CONNECT_FAILED;
         }
@@ -284,90 +329,375 @@ boolean PubSubClient::connect(const char *id, const char *user, const char *pass
     return true;
 }
 
-// reads a byte into result
-boolean PubSubClient::readByte(uint8_t * result) {
-   uint32_t previousMillis = millis();
-   while(!_client->available()) {
-     yield();
-     uint32_t currentMillis = millis();
-     if(currentMillis - previousMillis >= ((int32_t) this->socketTimeout * 1000)){
-       return false;
-     }
-   }
-   *result = _client->read();
-   return true;
-}
-
-// reads a byte into result[*index] and increments index
-boolean PubSubClient::readByte(uint8_t * result, uint16_t * index){
-  uint16_t current_index = *index;
-  uint8_t * write_address = &(result[current_index]);
-  if(readByte(write_address)){
-    *index = current_index + 1;
-    return true;
-  }
-  return false;
+#if MQTT_VERSION == MQTT_VERSION_5
+// Maps the reason code of a refused MQTT 5 CONNACK to the return codes of MQTT 3.1.1, so state()
+// means the same in both versions. Codes without a counterpart are MQTT_CONNECT_FAILED.
+static int connackState(uint8_t reason) {
+    switch (reason) {
+        case 0x81: case 0x82: case 0x84: case 0x90: case 0x95: case 0x99: case 0x9A: case 0x9B:
+            return MQTT_CONNECT_BAD_PROTOCOL;    // Malformed, protocol error, unsupported version or feature
+        case 0x85:
+            return MQTT_CONNECT_BAD_CLIENT_ID;   // Client identifier not valid
+        case 0x86: case 0x8C:
+            return MQTT_CONNECT_BAD_CREDENTIALS; // Bad user name or password, bad authentication method
+        case 0x87: case 0x8A:
+            return MQTT_CONNECT_UNAUTHORIZED;    // Not authorized, banned
+        case 0x83: case 0x88: case 0x89: case 0x97: case 0x9C: case 0x9D: case 0x9F:
+            return MQTT_CONNECT_UNAVAILABLE;     // Server unavailable, busy, quota exceeded, moved or rate limited
+        default:
+            return MQTT_CONNECT_FAILED;          // Unspecified error and anything else
+    }
 }
+#endif
 
-uint32_t PubSubClient::readPacket(uint8_t* lengthLength) {
-    uint16_t len = 0;
-    if(!readByte(this->buffer, &len)) return 0;
-    bool isPublish = (this->buffer[0]&0xF0) == MQTTPUBLISH;
-    uint32_t multiplier = 1;
-    uint32_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint32_t start = 0;
-
-    do {
-        if (len == 5) {
-            // Invalid remaining length encoding - kill the connection
-            _state = MQTT_DISCONNECTED;
+int PubSubClient::poll() {
+    if (this->_state != MQTT_CONNECTING) {
+        return this->_state;
+    }
+    if (!_client->connected()) {
+        // The server closed the connection before the CONNACK
+        _state = MQTT_CONNECT_FAILED;
+        _client->stop();
+        return this->_state;
+    }
+    uint8_t llen;
+    uint32_t len = readPacket(&llen);
+    if (len == 0) {
+        if (this->_state == MQTT_CONNECTING && millis()-lastInActivity >= this->socketTimeout*1000UL) {
+            _state = MQTT_CONNECTION_TIMEOUT;
             _client->stop();
-            return 0;
         }
-        if(!readByte(&digit)) return 0;
-        this->buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
-        multiplier <<=7; //multiplier *= 128
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
+        return this->_state;
+    }
 
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if(!readByte(this->buffer, &len)) return 0;
-        if(!readByte(this->buffer, &len)) return 0;
-        skip = (this->buffer[*lengthLength+1]<<8)+this->buffer[*lengthLength+2];
-        start = 2;
-        if (this->buffer[0]&MQTTQOS1) {
-            // skip message id
-            skip += 2;
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (len >= (uint32_t)llen+4 && (this->rxBuffer[0]&0xF0) == MQTTCONNACK) {
+        // Flags, reason code and properties
+        if (this->rxBuffer[llen+2] == 0) {
+            readProperties(llen+3, len);
+#else
+    if (len == 4 && (this->rxBuffer[0]&0xF0) == MQTTCONNACK) {
+        if (this->rxBuffer[3] == 0) {
+#endif
+            lastInActivity = millis();
+            pingOutstanding = false;
+            _state = MQTT_CONNECTED;
+            // Send the messages that were not acknowledged on the previous connection again
+            for (uint8_t i = 0; i < this->inflightCount; i++) {
+                this->inflight[(this->inflightHead+i)%MQTT_MAX_INFLIGHT].sent = lastInActivity-MQTT_RETRY_TIMEOUT;
+            }
+            return this->_state;
+        } else {
+#if MQTT_VERSION == MQTT_VERSION_5
+            _state = connackState(this->rxBuffer[llen+2]);
+#else
+            _state = this->rxBuffer[llen+2];
+#endif
         }
+    } else {
+        _state = MQTT_CONNECT_FAILED;
     }
-    uint32_t idx = len;
+    _client->stop();
+    return this->_state;
+}
 
-    for (uint32_t i = start;i<length;i++) {
-        if(!readByte(&digit)) return 0;
-        if (this->stream) {
-            if (isPublish && idx-*lengthLength-2>skip) {
-                this->stream->write(digit);
+// Reads whatever part of the current packet has arrived, without waiting for more.
+// Returns the length of the packet in the buffer once it is complete, 0 while it is incomplete,
+// if it did not fit in the buffer, if it was delivered in chunks or if the connection was closed.
+uint32_t PubSubClient::readPacket(uint8_t* lengthLength) {
+    int available = _client->available();
+    while (available > 0 || (this->readStage == MQTT_READ_BODY && this->readIndex == this->readLength)) {
+        if (this->readStage == MQTT_READ_HEADER) {
+            this->rxBuffer[0] = _client->read();
+            available--;
+            this->readLen = 1;
+            this->readLength = 0;
+            this->readShift = 0;
+            this->readIndex = 0;
+            this->readSkip = 0;
+            this->readProps = false;
+            this->readStart = millis();
+            this->readStage = MQTT_READ_LENGTH;
+        } else if (this->readStage == MQTT_READ_LENGTH) {
+            if (this->readLen == 5) {
+                // Invalid remaining length encoding - kill the connection
+                this->readStage = MQTT_READ_HEADER;
+                _state = MQTT_DISCONNECTED;
+                _client->stop();
+                return 0;
+            }
+            uint8_t digit = _client->read();
+            available--;
+            this->rxBuffer[this->readLen++] = digit;
+            this->readLength += (uint32_t)(digit & 127) << this->readShift;
+            this->readShift += 7;
+            if ((digit & 128) == 0) {
+                this->readLlen = this->readLen-1;
+                this->readStage = MQTT_READ_BODY;
+                // A message too large for the buffer goes to the chunk handlers, if there are any
+                this->readChunked = this->messageChunk && (this->rxBuffer[0]&0xF0) == MQTTPUBLISH &&
+                                    this->readLen+this->readLength > this->rxBufferSize;
+            }
+        } else if (this->readIndex < this->readLength) {
+            // Read in bulk, straight into the buffer while there is room
+            uint8_t scratch[MQTT_READ_CHUNK];
+            uint8_t* dest = scratch;
+            uint32_t n = this->readLength-this->readIndex;
+            if (n > (uint32_t)available) {
+                n = available;
+            }
+            if (this->readChunked && (this->readIndex < 2 || this->readIndex < this->readSkip)) {
+                // Stop at the end of the topic length and of the topic, so the message can be begun there
+                uint32_t end = this->readIndex < 2 ? 2 : this->readSkip;
+                if (n > end-this->readIndex) {
+                    n = end-this->readIndex;
+                }
             }
+            if (this->readLen < this->rxBufferSize) {
+                dest = this->rxBuffer+this->readLen;
+                if (n > (uint32_t)(this->rxBufferSize-this->readLen)) {
+                    n = this->rxBufferSize-this->readLen;
+                }
+            } else if (n > sizeof(scratch)) {
+                n = sizeof(scratch);
+            }
+            int rc = _client->read(dest,n);
+            if (rc <= 0) {
+                break;
+            }
+            available -= rc;
+            if (this->readIndex < 2 && this->readIndex+rc >= 2 && (this->rxBuffer[0]&0xF0) == MQTTPUBLISH) {
+                // The topic length is the first 2 bytes, which always land in the buffer
+                uint8_t llen = this->readLlen;
+                this->readSkip = 2+(this->rxBuffer[llen+1]<<8)+this->rxBuffer[llen+2];
+                if (this->rxBuffer[0]&MQTTQOS1) {
+                    // skip message id
+                    this->readSkip += 2;
+                }
+#if MQTT_VERSION == MQTT_VERSION_5
+                // and the properties, their length follows
+                this->readSkip += 1;
+                this->readProps = true;
+                this->readPropLength = 0;
+                this->readPropShift = 0;
+#endif
+            }
+#if MQTT_VERSION == MQTT_VERSION_5
+            while (this->readProps && this->readIndex+(uint32_t)rc >= this->readSkip) {
+                if (this->readLlen+1+this->readSkip > this->readLen+(dest != scratch ? (uint32_t)rc : 0) || this->readPropShift > 21) {
+                    this->readProps = false; // Not in the buffer or malformed, the message is ignored
+                    this->readChunked = false;
+                    break;
+                }
+                uint8_t digit = this->rxBuffer[this->readLlen+this->readSkip]; // Last byte of the skip
+                this->readPropLength += (uint32_t)(digit & 127) << this->readPropShift;
+                this->readPropShift += 7;
+                if (digit & 128) {
+                    this->readSkip++;
+                } else {
+                    this->readSkip += this->readPropLength;
+                    this->readProps = false;
+                }
+            }
+#endif
+            if (this->readChunked && this->readSkip && (this->readSkip > this->readLength || this->readLlen+1+this->readSkip > this->rxBufferSize)) {
+                this->readChunked = false; // The topic does not fit, ignore the message
+            }
+            if (this->stream && (this->rxBuffer[0]&0xF0) == MQTTPUBLISH) {
+                forwardPayload(dest,rc);
+            }
+            if (this->readChunked && this->readSkip && !this->readProps && this->readIndex >= this->readSkip) {
+                // Every chunk of the payload is read into the same place behind the topic
+                this->messageChunk(dest,rc);
+            } else if (dest != scratch) {
+                this->readLen += rc;
+            }
+            this->readIndex += rc;
+            if (this->readChunked && !this->readProps && this->readIndex == this->readSkip) {
+                beginChunked();
+            }
+        } else {
+            // Complete
+            this->readStage = MQTT_READ_HEADER;
+            *lengthLength = this->readLlen;
+            if (this->readChunked) {
+                endChunked();
+                return 0;
+            }
+            if (!this->stream && this->readLlen+1+this->readLength > this->rxBufferSize) {
+                return 0; // This will cause the packet to be ignored.
+            }
+            return this->readLen;
+        }
+    }
+    if (this->readStage != MQTT_READ_HEADER && millis()-this->readStart >= this->socketTimeout*1000UL) {
+        // The rest of the packet did not arrive
+        this->readStage = MQTT_READ_HEADER;
+        _state = MQTT_CONNECTION_TIMEOUT;
+        _client->stop();
+    }
+    return 0;
+}
+
+// Writes the payload part of count PUBLISH bytes just read at data to the stream
+void PubSubClient::forwardPayload(const uint8_t* data, uint32_t count) {
+    uint32_t offset = this->readIndex; // Offset of data in the variable header and payload
+    if (this->readSkip == 0 || offset+count <= this->readSkip) {
+        return;
+    }
+    if (offset < this->readSkip) {
+        data += this->readSkip-offset;
+        count -= this->readSkip-offset;
+    }
+    this->stream->write(data,count);
+}
+
+// Ends the topic of the PUBLISH in the receive buffer as a C string and reads the message id.
+// Sets *pos to the payload. Returns the topic, NULL if it is an unknown topic alias.
+char* PubSubClient::publishTopic(uint8_t llen, uint32_t end, uint32_t* pos, uint16_t* msgId) {
+    uint16_t tl = (this->rxBuffer[llen+1]<<8)+this->rxBuffer[llen+2]; /* topic length in bytes */
+    uint32_t p = llen+3+tl;
+    // msgId only present for QOS>0
+    if ((this->rxBuffer[0]&0x06) == MQTTQOS1) {
+        *msgId = (this->rxBuffer[p]<<8)+this->rxBuffer[p+1];
+        p += 2;
+    }
+    memmove(this->rxBuffer+llen+2,this->rxBuffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
+    this->rxBuffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
+    char *topic = (char*) this->rxBuffer+llen+2;
+#if MQTT_VERSION == MQTT_VERSION_5
+    p = readProperties(p, end);
+    if (p == 0) {
+        return NULL;
+    }
+    if (this->propertyAlias > 0) {
+        if (this->propertyAlias > MQTT_MAX_TOPIC_ALIASES) {
+            return NULL;
+        }
+        char* known = this->aliasIn[this->propertyAlias-1];
+        if (tl == 0) {
+            topic = known; // The broker sent the topic with this alias before
+        } else if (tl < MQTT_ALIAS_TOPIC_SIZE) {
+            memcpy(known, topic, tl+1);
+        } else {
+            known[0] = 0; // Too long to remember
+        }
+        if (topic[0] == 0) {
+            return NULL;
         }
+    }
+#else
+    (void)end;
+#endif
+    *pos = p;
+    return topic;
+}
 
-        if (len < this->bufferSize) {
-            this->buffer[len] = digit;
-            len++;
+#if MQTT_VERSION == MQTT_VERSION_5
+// Reads the properties at pos in the receive buffer, their length first, and keeps the few this
+// client uses. Returns the position behind them, 0 if they run past end or are malformed.
+uint32_t PubSubClient::readProperties(uint32_t pos, uint32_t end) {
+    uint32_t length = 0;
+    uint8_t shift = 0;
+    uint8_t digit;
+    this->propertyAlias = 0;
+    do {
+        if (pos >= end || shift > 21) {
+            return 0;
         }
-        idx++;
+        digit = this->rxBuffer[pos++];
+        length += (uint32_t)(digit & 127) << shift;
+        shift += 7;
+    } while (digit & 128);
+    if (length > end-pos) {
+        return 0;
+    }
+    end = pos+length;
+    while (pos < end) {
+        uint8_t id = this->rxBuffer[pos++];
+        uint32_t size;
+        switch (id) {
+            case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+                size = 1;
+                break;
+            case 0x13: case 0x21: case 0x22: case 0x23:
+                size = 2;
+                break;
+            case 0x02: case 0x11: case 0x18: case 0x27:
+                size = 4;
+                break;
+            case 0x0B: // Variable byte integer
+                size = 1;
+                while (pos+size <= end && (this->rxBuffer[pos+size-1] & 128)) {
+                    size++;
+                }
+                break;
+            case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+            case 0x26: // Strings and binary data, a user property is two strings
+                if (pos+2 > end) {
+                    return 0;
+                }
+                size = 2+((this->rxBuffer[pos]<<8)+this->rxBuffer[pos+1]);
+                if (id == 0x26) {
+                    if (pos+size+2 > end) {
+                        return 0;
+                    }
+                    size += 2+((this->rxBuffer[pos+size]<<8)+this->rxBuffer[pos+size+1]);
+                }
+                break;
+            default:
+                return 0;
+        }
+        if (size > end-pos) {
+            return 0;
+        }
+        uint16_t value = size == 2 ? (this->rxBuffer[pos]<<8)+this->rxBuffer[pos+1] : 0;
+        if (id == 0x21) {
+            this->serverReceiveMax = value; // Receive maximum of the broker
+        } else if (id == 0x22) {
+            this->aliasOutMax = value;      // Topic alias maximum of the broker
+        } else if (id == 0x23) {
+            this->propertyAlias = value;    // Topic alias of a PUBLISH
+        }
+        pos += size;
+    }
+    return pos;
+}
+#endif
+
+// The topic of a chunked message is in the buffer, hand it to the begin handler
+void PubSubClient::beginChunked() {
+    uint32_t pos;
+    char* topic = publishTopic(this->readLlen, this->readLen, &pos, &this->readMsgId);
+    if (topic == NULL) {
+        this->readChunked = false; // Read to the end and ignored
+        return;
+    }
+    if (this->messageBegin) {
+        this->messageBegin(topic, this->readLength-this->readSkip);
     }
+}
 
-    if (!this->stream && idx > this->bufferSize) {
-        len = 0; // This will cause the packet to be ignored.
+void PubSubClient::endChunked() {
+    this->readChunked = false;
+    lastInActivity = millis();
+    if (this->messageEnd) {
+        this->messageEnd();
+    }
+    if (this->rxBuffer[0]&MQTTQOS1) {
+        this->txBuffer[0] = MQTTPUBACK;
+        this->txBuffer[1] = 2;
+        this->txBuffer[2] = (this->readMsgId >> 8);
+        this->txBuffer[3] = (this->readMsgId & 0xFF);
+        writeBytes(this->txBuffer,4);
+        lastOutActivity = lastInActivity;
     }
-    return len;
 }
 
 boolean PubSubClient::loop() {
+    if (this->_state == MQTT_CONNECTING) {
+        return poll() == MQTT_CONNECTED;
+    }
     if (connected()) {
         unsigned long t = millis();
         if ((t - lastInActivity > this->keepAlive*1000UL) || (t - lastOutActivity > this->keepAlive*1000UL)) {
@@ -376,69 +706,74 @@ boolean PubSubClient::loop() {
                 _client->stop();
                 return false;
             } else {
-                this->buffer[0] = MQTTPINGREQ;
-                this->buffer[1] = 0;
-                _client->write(this->buffer,2);
+                this->txBuffer[0] = MQTTPINGREQ;
+                this->txBuffer[1] = 0;
+                writeBytes(this->txBuffer,2);
                 lastOutActivity = t;
                 lastInActivity = t;
                 pingOutstanding = true;
             }
         }
-        if (_client->available()) {
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
-            uint16_t msgId = 0;
-            uint8_t *payload;
-            if (len > 0) {
-                lastInActivity = t;
-                uint8_t type = this->buffer[0]&0xF0;
-                if (type == MQTTPUBLISH) {
-                    if (callback) {
-                        uint16_t tl = (this->buffer[llen+1]<<8)+this->buffer[llen+2]; /* topic length in bytes */
-                        memmove(this->buffer+llen+2,this->buffer+llen+3,tl); /* move topic inside buffer 1 byte to front */
-                        this->buffer[llen+2+tl] = 0; /* end the topic as a 'C' string with \x00 */
-                        char *topic = (char*) this->buffer+llen+2;
-                        // msgId only present for QOS>0
-                        if ((this->buffer[0]&0x06) == MQTTQOS1) {
-                            msgId = (this->buffer[llen+3+tl]<<8)+this->buffer[llen+3+tl+1];
-                            payload = this->buffer+llen+3+tl+2;
-                            callback(topic,payload,len-llen-3-tl-2);
-
-                            this->buffer[0] = MQTTPUBACK;
-                            this->buffer[1] = 2;
-                            this->buffer[2] = (msgId >> 8);
-                            this->buffer[3] = (msgId & 0xFF);
-                            _client->write(this->buffer,4);
-                            lastOutActivity = t;
-
-                        } else {
-                            payload = this->buffer+llen+3+tl;
-                            callback(topic,payload,len-llen-3-tl);
-                        }
+        uint8_t llen;
+        uint16_t len = readPacket(&llen);
+        uint16_t msgId = 0;
+        if (len > 0) {
+            lastInActivity = t;
+            uint8_t type = this->rxBuffer[0]&0xF0;
+            if (type == MQTTPUBLISH) {
+                if (callback || this->handlerCount > 0) {
+                    uint32_t pos;
+                    char *topic = publishTopic(llen, len, &pos, &msgId);
+                    if (topic) {
+                        deliver(topic,this->rxBuffer+pos,len-pos);
+                    }
+                    if ((this->rxBuffer[0]&0x06) == MQTTQOS1) {
+                        this->txBuffer[0] = MQTTPUBACK;
+                        this->txBuffer[1] = 2;
+                        this->txBuffer[2] = (msgId >> 8);
+                        this->txBuffer[3] = (msgId & 0xFF);
+                        writeBytes(this->txBuffer,4);
+                        lastOutActivity = t;
                     }
-                } else if (type == MQTTPINGREQ) {
-                    this->buffer[0] = MQTTPINGRESP;
-                    this->buffer[1] = 0;
-                    _client->write(this->buffer,2);
-                } else if (type == MQTTPINGRESP) {
-                    pingOutstanding = false;
                 }
-            } else if (!connected()) {
-                // readPacket has closed the connection
-                return false;
+            } else if (type == MQTTPINGREQ) {
+                this->txBuffer[0] = MQTTPINGRESP;
+                this->txBuffer[1] = 0;
+                writeBytes(this->txBuffer,2);
+            } else if (type == MQTTPINGRESP) {
+                pingOutstanding = false;
+            } else if (type == MQTTPUBACK) {
+                ackInflight((this->rxBuffer[llen+1]<<8)+this->rxBuffer[llen+2]);
+            } else if (type == MQTTSUBACK) {
+                uint32_t pos = llen+3;
+#if MQTT_VERSION == MQTT_VERSION_5
+                pos = len >= pos ? readProperties(pos, len) : 0;
+#endif
+                if (this->subackHandler && pos && len >= pos) {
+                    // One return code per filter, in the order of the SUBSCRIBE
+                    this->subackHandler((this->rxBuffer[llen+1]<<8)+this->rxBuffer[llen+2], this->rxBuffer+pos, len-pos);
+                }
+            } else if (type == MQTTUNSUBACK) {
+                if (this->unsubackHandler) {
+                    this->unsubackHandler((this->rxBuffer[llen+1]<<8)+this->rxBuffer[llen+2]);
+                }
             }
+        } else if (!connected()) {
+            // readPacket has closed the connection
+            return false;
         }
-        return true;
+        retryInflight(t);
+        return flushStaged(); // Everything written during this pass goes out together
     }
     return false;
 }
 
 boolean PubSubClient::publish(const char* topic, const char* payload) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,false);
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,false);
 }
 
 boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained) {
-    return publish(topic,(const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0,retained);
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,retained);
 }
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength) {
@@ -446,98 +781,126 @@ boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigne
 }
 
 boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-    if (connected()) {
-        if (this->bufferSize < MQTT_MAX_HEADER_SIZE + 2+strnlen(topic, this->bufferSize) + plength) {
-            // Too long
-            return false;
-        }
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
+    // The payload goes to the client as a second write, it is never copied into the buffer
+    if (!beginPublish(topic, plength, retained)) {
+        return false;
+    }
+    return writeBytes(payload, plength);
+}
 
-        // Add payload
-        uint16_t i;
-        for (i=0;i<plength;i++) {
-            this->buffer[length++] = payload[i];
-        }
+boolean PubSubClient::publish(const char* topic, const char* payload, boolean retained, uint8_t qos) {
+    return publish(topic,(const uint8_t*)payload, payload ? strlen(payload) : 0,retained,qos);
+}
 
-        // Write the header
-        uint8_t header = MQTTPUBLISH;
-        if (retained) {
-            header |= 1;
-        }
-        return write(header,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+boolean PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, uint8_t qos) {
+    if (qos == 0) {
+        return publish(topic, payload, plength, retained);
     }
-    return false;
+    if (qos > 1) {
+        return false;
+    }
+    size_t tlen = strnlen(topic, MQTT_INFLIGHT_SIZE);
+    if (this->inflightCount >= this->inflightWindow || 2+tlen+2+MQTT_PROPERTY_BYTES+plength > MQTT_INFLIGHT_SIZE) {
+        return false;
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (this->inflightCount >= this->serverReceiveMax) {
+        return false;
+    }
+#endif
+    MQTTInflight& message = this->inflight[(this->inflightHead+this->inflightCount)%MQTT_MAX_INFLIGHT];
+    this->inflightCount++;
+    message.header = MQTTPUBLISH|MQTTQOS1;
+    if (retained) {
+        message.header |= 1;
+    }
+    message.msgId = newMsgId();
+    uint16_t length = writeString(topic, message.data, 0);
+    message.data[length++] = (message.msgId >> 8);
+    message.data[length++] = (message.msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+    message.data[length++] = 0; // No properties, a message that is sent again may not use an alias
+#endif
+    memcpy(message.data+length, payload, plength);
+    message.length = length+plength;
+    if (connected()) {
+        sendInflight(message);
+    }
+    return true;
 }
 
 boolean PubSubClient::publish_P(const char* topic, const char* payload, boolean retained) {
-    return publish_P(topic, (const uint8_t*)payload, payload ? strnlen(payload, this->bufferSize) : 0, retained);
+    return publish_P(topic, (const uint8_t*)payload, payload ? strlen_P(payload) : 0, retained);
 }
 
 boolean PubSubClient::publish_P(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained) {
-    uint8_t llen = 0;
-    uint8_t digit;
-    unsigned int rc = 0;
-    uint16_t tlen;
-    unsigned int pos = 0;
-    unsigned int i;
-    uint8_t header;
-    unsigned int len;
-    int expectedLength;
-
-    if (!connected()) {
+    if (!beginPublish(topic, plength, retained)) {
         return false;
     }
+    // Copy from flash through a small stack buffer
+    uint8_t chunk[MQTT_READ_CHUNK];
+    unsigned int pos = 0;
+    while (pos < plength) {
+        unsigned int n = plength-pos > sizeof(chunk) ? sizeof(chunk) : plength-pos;
+        memcpy_P(chunk, payload+pos, n);
+        if (!writeBytes(chunk, n)) {
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
 
-    tlen = strnlen(topic, this->bufferSize);
-
-    header = MQTTPUBLISH;
+boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
+    uint8_t header = MQTTPUBLISH;
     if (retained) {
         header |= 1;
     }
-    this->buffer[pos++] = header;
-    len = plength + 2 + tlen;
-    do {
-        digit = len  & 127; //digit = len %128
-        len >>= 7; //len = len / 128
-        if (len > 0) {
-            digit |= 0x80;
-        }
-        this->buffer[pos++] = digit;
-        llen++;
-    } while(len>0);
-
-    pos = writeString(topic,this->buffer,pos);
-
-    rc += _client->write(this->buffer,pos);
-
-    for (i=0;i<plength;i++) {
-        rc += _client->write((char)pgm_read_byte_near(payload + i));
-    }
-
-    lastOutActivity = millis();
-
-    expectedLength = 1 + llen + 2 + tlen + plength;
-
-    return (rc == expectedLength);
+    return writePublishHeader(header, topic, plength);
 }
 
-boolean PubSubClient::beginPublish(const char* topic, unsigned int plength, boolean retained) {
-    if (connected()) {
-        // Send the header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        length = writeString(topic,this->buffer,length);
-        uint8_t header = MQTTPUBLISH;
-        if (retained) {
-            header |= 1;
-        }
-        size_t hlen = buildHeader(header, this->buffer, plength+length-MQTT_MAX_HEADER_SIZE);
-        uint16_t rc = _client->write(this->buffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
-        lastOutActivity = millis();
-        return (rc == (length-(MQTT_MAX_HEADER_SIZE-hlen)));
+// Writes the fixed header and the topic of a PUBLISH, the payload of plength bytes is written next
+boolean PubSubClient::writePublishHeader(uint8_t header, const char* topic, uint32_t plength) {
+    if (!connected()) {
+        return false;
     }
-    return false;
+    size_t tlen = strnlen(topic, this->txBufferSize);
+    if (this->txBufferSize < MQTT_MAX_HEADER_SIZE + 2 + tlen + MQTT_PUBLISH_PROPERTY_BYTES) {
+        // Topic too long
+        return false;
+    }
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = MQTT_MAX_HEADER_SIZE;
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Once the broker knows the alias of a topic, the topic itself is left empty
+    uint8_t alias = 0;
+    boolean known = false;
+    for (uint8_t i = 0; i < this->aliasOutCount; i++) {
+        if (strcmp(this->aliasOut[i], topic) == 0) {
+            alias = i+1;
+            known = true;
+            break;
+        }
+    }
+    if (!alias && this->aliasOutCount < this->aliasOutMax && this->aliasOutCount < MQTT_MAX_TOPIC_ALIASES && tlen < MQTT_ALIAS_TOPIC_SIZE) {
+        // Sent with the topic this once, so the broker learns the alias
+        memcpy(this->aliasOut[this->aliasOutCount], topic, tlen+1);
+        alias = ++this->aliasOutCount;
+    }
+    length = writeString(known ? "" : topic,this->txBuffer,length);
+    if (alias) {
+        this->txBuffer[length++] = 3;
+        this->txBuffer[length++] = 0x23; // Topic alias
+        this->txBuffer[length++] = 0;
+        this->txBuffer[length++] = alias;
+    } else {
+        this->txBuffer[length++] = 0; // No properties
+    }
+#else
+    length = writeString(topic,this->txBuffer,length);
+#endif
+    size_t hlen = buildHeader(header, this->txBuffer, plength+length-MQTT_MAX_HEADER_SIZE);
+    return writeBytes(this->txBuffer+(MQTT_MAX_HEADER_SIZE-hlen),length-(MQTT_MAX_HEADER_SIZE-hlen));
 }
 
 int PubSubClient::endPublish() {
@@ -545,21 +908,19 @@ int PubSubClient::endPublish() {
 }
 
 size_t PubSubClient::write(uint8_t data) {
-    lastOutActivity = millis();
-    return _client->write(data);
+    return writeBytes(&data,1) ? 1 : 0;
 }
 
 size_t PubSubClient::write(const uint8_t *buffer, size_t size) {
-    lastOutActivity = millis();
-    return _client->write(buffer,size);
+    return writeBytes(buffer,size) ? size : 0;
 }
 
-size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length) {
+size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint32_t length) {
     uint8_t lenBuf[4];
     uint8_t llen = 0;
     uint8_t digit;
     uint8_t pos = 0;
-    uint16_t len = length;
+    uint32_t len = length;
     do {
 
         digit = len  & 127; //digit = len %128
@@ -579,88 +940,382 @@ size_t PubSubClient::buildHeader(uint8_t header, uint8_t* buf, uint16_t length)
 }
 
 boolean PubSubClient::write(uint8_t header, uint8_t* buf, uint16_t length) {
-    uint16_t rc;
     uint8_t hlen = buildHeader(header, buf, length);
+    return writeBytes(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
+}
 
-#ifdef MQTT_MAX_TRANSFER_SIZE
-    uint8_t* writeBuf = buf+(MQTT_MAX_HEADER_SIZE-hlen);
-    uint16_t bytesRemaining = length+hlen;  //Match the length type
-    uint8_t bytesToWrite;
-    boolean result = true;
-    while((bytesRemaining > 0) && result) {
-        bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE)?MQTT_MAX_TRANSFER_SIZE:bytesRemaining;
-        rc = _client->write(writeBuf,bytesToWrite);
-        result = (rc == bytesToWrite);
-        bytesRemaining -= rc;
-        writeBuf += rc;
+// Collects the bytes in the staging buffer when there is one, otherwise writes them right away
+boolean PubSubClient::writeBytes(const uint8_t* buf, uint32_t length) {
+    lastOutActivity = millis();
+    if (this->stageSize == 0) {
+        return sendBytes(buf,length);
+    }
+    if (this->stageUsed > 0 && (this->stageUsed+length > this->stageSize || lastOutActivity-this->stageStart >= this->stageLatency)) {
+        if (!sendStaged()) {
+            return false;
+        }
+    }
+    if (length > this->stageSize) {
+        return sendBytes(buf,length);
+    }
+    if (this->stageUsed == 0) {
+        this->stageStart = lastOutActivity;
+    }
+    memcpy(this->stageBuffer+this->stageUsed,buf,length);
+    this->stageUsed += length;
+    return true;
+}
+
+// Writes the staged packets. After a short write the stream ends inside a packet and anything
+// written after it would be misread by the broker, so the connection is closed.
+boolean PubSubClient::sendStaged() {
+    boolean result = sendBytes(this->stageBuffer,this->stageUsed);
+    this->stageUsed = 0;
+    if (!result) {
+        _state = MQTT_CONNECTION_LOST;
+        _client->stop();
     }
     return result;
-#else
-    rc = _client->write(buf+(MQTT_MAX_HEADER_SIZE-hlen),length+hlen);
-    lastOutActivity = millis();
-    return (rc == hlen+length);
+}
+
+void PubSubClient::flush() {
+    flushStaged();
+}
+
+boolean PubSubClient::flushStaged() {
+    if (this->stageUsed > 0) {
+        return sendStaged();
+    }
+    return true;
+}
+
+PubSubClient& PubSubClient::setTxStaging(uint8_t* storage, uint16_t size, uint16_t maxLatency) {
+    flush();
+    this->stageBuffer = storage;
+    this->stageSize = storage ? size : 0;
+    this->stageLatency = maxLatency;
+    return *this;
+}
+
+// A client may take only part of the data, for instance when its socket buffer is nearly full.
+// The rest is written until it takes nothing at all.
+boolean PubSubClient::sendBytes(const uint8_t* buf, uint32_t length) {
+    while (length > 0) {
+        uint32_t bytesToWrite = length;
+#ifdef MQTT_MAX_TRANSFER_SIZE
+        if (bytesToWrite > MQTT_MAX_TRANSFER_SIZE) {
+            bytesToWrite = MQTT_MAX_TRANSFER_SIZE;
+        }
 #endif
+        size_t rc = _client->write(buf,bytesToWrite);
+        if (rc == 0) {
+            return false;
+        }
+        length -= rc;
+        buf += rc;
+    }
+    return true;
+}
+
+boolean PubSubClient::sendInflight(MQTTInflight& message) {
+    uint8_t header[MQTT_MAX_HEADER_SIZE];
+    size_t hlen = buildHeader(message.header, header, message.length);
+    message.sent = millis();
+    message.header |= MQTTDUP; // Any later transmission is a duplicate
+    return writeBytes(header+(MQTT_MAX_HEADER_SIZE-hlen), hlen) && writeBytes(message.data, message.length);
+}
+
+// Sends the QoS 1 messages that were never sent or whose PUBACK is overdue
+void PubSubClient::retryInflight(unsigned long t) {
+    for (uint8_t i = 0; i < this->inflightCount; i++) {
+        MQTTInflight& message = this->inflight[(this->inflightHead+i)%MQTT_MAX_INFLIGHT];
+        if (message.msgId == 0) {
+            continue;
+        }
+        if ((message.header & MQTTDUP) == 0 || t-message.sent >= MQTT_RETRY_TIMEOUT) {
+            if (!sendInflight(message)) {
+                return;
+            }
+        }
+    }
+}
+
+void PubSubClient::ackInflight(uint16_t msgId) {
+    for (uint8_t i = 0; i < this->inflightCount; i++) {
+        MQTTInflight& message = this->inflight[(this->inflightHead+i)%MQTT_MAX_INFLIGHT];
+        if (message.msgId == msgId) {
+            message.msgId = 0;
+            break;
+        }
+    }
+    // Free the acknowledged slots at the start of the ring, later ones are freed once the
+    // earlier messages are acknowledged too
+    while (this->inflightCount > 0 && this->inflight[this->inflightHead].msgId == 0) {
+        this->inflightHead = (this->inflightHead+1)%MQTT_MAX_INFLIGHT;
+        this->inflightCount--;
+    }
+}
+
+uint16_t PubSubClient::newMsgId() {
+    nextMsgId++;
+    if (nextMsgId == 0) {
+        nextMsgId = 1;
+    }
+    return nextMsgId;
 }
 
 boolean PubSubClient::subscribe(const char* topic) {
-    return subscribe(topic, 0);
+    return subscribe(topic, (uint8_t)0);
 }
 
 boolean PubSubClient::subscribe(const char* topic, uint8_t qos) {
-    size_t topicLength = strnlen(topic, this->bufferSize);
-    if (topic == 0) {
-        return false;
+    return subscribe(&topic, &qos, 1) != 0;
+}
+
+uint16_t PubSubClient::subscribe(const char* filters[], const uint8_t qos[], uint8_t count) {
+    if (count == 0 || !connected()) {
+        return 0;
     }
-    if (qos > 1) {
-        return false;
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = MQTT_MAX_HEADER_SIZE+2+MQTT_PROPERTY_BYTES;
+    for (uint8_t i = 0; i < count; i++) {
+        if (filters[i] == 0 || (qos && qos[i] > 1)) {
+            return 0;
+        }
+        length += 2+strnlen(filters[i], this->txBufferSize)+1;
+        if (length > this->txBufferSize) {
+            // Too long
+            return 0;
+        }
     }
-    if (this->bufferSize < 9 + topicLength) {
-        // Too long
-        return false;
+    length = MQTT_MAX_HEADER_SIZE;
+    uint16_t msgId = newMsgId();
+    this->txBuffer[length++] = (msgId >> 8);
+    this->txBuffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+    this->txBuffer[length++] = 0; // No properties
+#endif
+    for (uint8_t i = 0; i < count; i++) {
+        length = writeString(filters[i], this->txBuffer,length);
+        this->txBuffer[length++] = qos ? qos[i] : 0;
     }
-    if (connected()) {
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString((char*)topic, this->buffer,length);
-        this->buffer[length++] = qos;
-        return write(MQTTSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+    if (!write(MQTTSUBSCRIBE|MQTTQOS1,this->txBuffer,length-MQTT_MAX_HEADER_SIZE)) {
+        return 0;
     }
-    return false;
+    return msgId;
 }
 
-boolean PubSubClient::unsubscribe(const char* topic) {
-	size_t topicLength = strnlen(topic, this->bufferSize);
-    if (topic == 0) {
+boolean PubSubClient::subscribe(const char* filter, MQTTHandler handler, uint8_t qos) {
+    if (!addRoute(filter, handler)) {
         return false;
     }
-    if (this->bufferSize < 9 + topicLength) {
-        // Too long
-        return false;
+    return subscribe(filter, qos);
+}
+
+boolean PubSubClient::setHandler(uint8_t* slot, MQTTHandler handler) {
+    if (*slot == MQTT_NO_ROUTE) {
+        if (this->handlerCount >= MQTT_MAX_HANDLERS) {
+            return false;
+        }
+        *slot = this->handlerCount++;
     }
-    if (connected()) {
-        uint16_t length = MQTT_MAX_HEADER_SIZE;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
+    this->handlers[*slot] = handler;
+    return true;
+}
+
+boolean PubSubClient::addRoute(const char* filter, MQTTHandler handler) {
+    if (!strpbrk(filter, "+#")) {
+        uint16_t length = 0;
+        uint8_t sum = 0;
+        for (const char* c = filter; *c; c++, length++) {
+            sum += *c;
+        }
+        uint8_t i = 0;
+        while (i < this->literalCount && (this->literals[i].length != length || strcmp(this->literals[i].filter, filter))) {
+            i++;
         }
-        this->buffer[length++] = (nextMsgId >> 8);
-        this->buffer[length++] = (nextMsgId & 0xFF);
-        length = writeString(topic, this->buffer,length);
-        return write(MQTTUNSUBSCRIBE|MQTTQOS1,this->buffer,length-MQTT_MAX_HEADER_SIZE);
+        if (i == this->literalCount) {
+            uint8_t slot = MQTT_NO_ROUTE;
+            if (!setHandler(&slot, handler)) {
+                return false;
+            }
+            this->literals[this->literalCount++] = {filter, length, sum, slot};
+            return true;
+        }
+        return setHandler(&this->literals[i].handler, handler);
     }
-    return false;
+    uint8_t node = 0;
+    const char* level = filter;
+    while (true) {
+        const char* end = level;
+        while (*end && *end != '/') {
+            end++;
+        }
+        uint8_t length = end-level;
+        if (length == 1 && level[0] == '#') {
+            return *end == 0 && setHandler(&this->routes[node].rest, handler);
+        }
+        boolean plus = length == 1 && level[0] == '+';
+        uint8_t child = plus ? this->routes[node].plus : this->routes[node].child;
+        while (child != MQTT_NO_ROUTE && (this->routes[child].length != length || memcmp(this->routes[child].level, level, length))) {
+            child = this->routes[child].next;
+        }
+        if (child == MQTT_NO_ROUTE) {
+            if (this->routeCount >= MQTT_MAX_ROUTES) {
+                return false;
+            }
+            child = this->routeCount++;
+            this->routes[child].level = level;
+            this->routes[child].length = length;
+            if (plus) {
+                this->routes[node].plus = child;
+            } else {
+                this->routes[child].next = this->routes[node].child;
+                this->routes[node].child = child;
+            }
+        }
+        node = child;
+        if (*end == 0) {
+            break;
+        }
+        level = end+1;
+    }
+    return setHandler(&this->routes[node].handler, handler);
+}
+
+// Calls the handlers of all filters matching topic: the one filter without wildcards equal to
+// it, then those with wildcards, following every matching branch of the trie level by level.
+// Returns 0 if no filter matched.
+boolean PubSubClient::dispatch(char* topic, uint8_t* payload, unsigned int length) {
+    boolean matched = false;
+    if (this->literalCount <= MQTT_LITERAL_SCAN) {
+        for (uint8_t i = 0; i < this->literalCount; i++) {
+            if (strcmp(this->literals[i].filter, topic) == 0) {
+                this->handlers[this->literals[i].handler](topic,payload,length);
+                matched = true;
+                break;
+            }
+        }
+    } else {
+        uint16_t topicLength = 0;
+        uint8_t sum = 0;
+        for (const char* c = topic; *c; c++, topicLength++) {
+            sum += *c;
+        }
+        for (uint8_t i = 0; i < this->literalCount; i++) {
+            MQTTLiteral& literal = this->literals[i];
+            if (literal.sum == sum && literal.length == topicLength && memcmp(literal.filter, topic, topicLength) == 0) {
+                this->handlers[literal.handler](topic,payload,length);
+                matched = true;
+                break;
+            }
+        }
+    }
+    if (this->routeCount == 1) {
+        return matched;
+    }
+    uint8_t active[MQTT_MAX_ROUTES];
+    uint8_t next[MQTT_MAX_ROUTES];
+    uint8_t activeCount = 1;
+    uint8_t nextCount = 0;
+    boolean wildcards = topic[0] != '$'; // Wildcards do not match the first level of $SYS topics
+    active[0] = 0;
+    const char* level = topic;
+    while (activeCount > 0) {
+        const char* end = level;
+        while (*end && *end != '/') {
+            end++;
+        }
+        uint8_t levelLength = end-level;
+        nextCount = 0;
+        for (uint8_t i = 0; i < activeCount; i++) {
+            MQTTRoute& node = this->routes[active[i]];
+            if (wildcards && node.rest != MQTT_NO_ROUTE) {
+                this->handlers[node.rest](topic,payload,length);
+                matched = true;
+            }
+            // Nodes of one level have different levels, at most one of them matches
+            for (uint8_t c = node.child; c != MQTT_NO_ROUTE; c = this->routes[c].next) {
+                MQTTRoute& route = this->routes[c];
+                if (route.length == levelLength && memcmp(route.level, level, levelLength) == 0) {
+                    next[nextCount++] = c;
+                    break;
+                }
+            }
+            if (wildcards && node.plus != MQTT_NO_ROUTE) {
+                next[nextCount++] = node.plus;
+            }
+        }
+        if (*end == 0) {
+            break;
+        }
+        memcpy(active, next, nextCount);
+        activeCount = nextCount;
+        nextCount = 0;
+        level = end+1;
+        wildcards = true;
+    }
+    // The topic is complete: filters ending here match, and so does a # below them
+    for (uint8_t i = 0; i < nextCount; i++) {
+        MQTTRoute& route = this->routes[next[i]];
+        if (route.handler != MQTT_NO_ROUTE) {
+            this->handlers[route.handler](topic,payload,length);
+            matched = true;
+        }
+        if (route.rest != MQTT_NO_ROUTE) {
+            this->handlers[route.rest](topic,payload,length);
+            matched = true;
+        }
+    }
+    return matched;
+}
+
+void PubSubClient::deliver(char* topic, uint8_t* payload, unsigned int length) {
+    if (!dispatch(topic,payload,length) && callback) {
+        callback(topic,payload,length);
+    }
+}
+
+boolean PubSubClient::unsubscribe(const char* topic) {
+    return unsubscribe(&topic, 1) != 0;
+}
+
+uint16_t PubSubClient::unsubscribe(const char* filters[], uint8_t count) {
+    if (count == 0 || !connected()) {
+        return 0;
+    }
+    uint16_t length = MQTT_MAX_HEADER_SIZE+2+MQTT_PROPERTY_BYTES;
+    for (uint8_t i = 0; i < count; i++) {
+        if (filters[i] == 0) {
+            return 0;
+        }
+        length += 2+strnlen(filters[i], this->txBufferSize);
+        if (length > this->txBufferSize) {
+            // Too long
+            return 0;
+        }
+    }
+    length = MQTT_MAX_HEADER_SIZE;
+    uint16_t msgId = newMsgId();
+    this->txBuffer[length++] = (msgId >> 8);
+    this->txBuffer[length++] = (msgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+    this->txBuffer[length++] = 0; // No properties
+#endif
+    for (uint8_t i = 0; i < count; i++) {
+        length = writeString(filters[i], this->txBuffer,length);
+    }
+    if (!write(MQTTUNSUBSCRIBE|MQTTQOS1,this->txBuffer,length-MQTT_MAX_HEADER_SIZE)) {
+        return 0;
+    }
+    return msgId;
 }
 
 void PubSubClient::disconnect() {
-    this->buffer[0] = MQTTDISCONNECT;
-    this->buffer[1] = 0;
-    _client->write(this->buffer,2);
+    this->txBuffer[0] = MQTTDISCONNECT;
+    this->txBuffer[1] = 0;
+    writeBytes(this->txBuffer,2);
+    flush();
     _state = MQTT_DISCONNECTED;
     _client->flush();
     _client->stop();
@@ -723,6 +1378,31 @@ PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
     return *this;
 }
 
+PubSubClient& PubSubClient::onMessageBegin(MQTTBeginHandler handler) {
+    this->messageBegin = handler;
+    return *this;
+}
+
+PubSubClient& PubSubClient::onMessageChunk(MQTTChunkHandler handler) {
+    this->messageChunk = handler;
+    return *this;
+}
+
+PubSubClient& PubSubClient::onMessageEnd(MQTTEndHandler handler) {
+    this->messageEnd = handler;
+    return *this;
+}
+
+PubSubClient& PubSubClient::onSuback(MQTTSubackHandler handler) {
+    this->subackHandler = handler;
+    return *this;
+}
+
+PubSubClient& PubSubClient::onUnsuback(MQTTUnsubackHandler handler) {
+    this->unsubackHandler = handler;
+    return *this;
+}
+
 PubSubClient& PubSubClient::setClient(Client& client){
     this->_client = &client;
     return *this;
@@ -738,27 +1418,79 @@ int PubSubClient::state() {
 }
 
 boolean PubSubClient::setBufferSize(uint16_t size) {
+    return setBufferSize(size, size);
+}
+
+boolean PubSubClient::setBufferSize(uint16_t rxSize, uint16_t txSize) {
+    return resizeBuffer(&this->rxBuffer, &this->rxBufferSize, &this->rxOwned, rxSize) &&
+           resizeBuffer(&this->txBuffer, &this->txBufferSize, &this->txOwned, txSize);
+}
+
+boolean PubSubClient::setBuffers(uint8_t* rx, uint16_t rxSize, uint8_t* tx, uint16_t txSize) {
+    if (rx == NULL || tx == NULL || rxSize == 0 || txSize < MQTT_MAX_HEADER_SIZE+2) {
+        return false;
+    }
+    if (this->rxOwned) {
+        free(this->rxBuffer);
+    }
+    if (this->txOwned) {
+        free(this->txBuffer);
+    }
+    this->rxBuffer = rx;
+    this->rxBufferSize = rxSize;
+    this->rxOwned = false;
+    this->txBuffer = tx;
+    this->txBufferSize = txSize;
+    this->txOwned = false;
+    return true;
+}
+
+// Allocates or grows one of the buffers, storage given by the caller is replaced by an allocated buffer
+boolean PubSubClient::resizeBuffer(uint8_t** buffer, uint16_t* bufferSize, bool* owned, uint16_t size) {
     if (size == 0) {
         // Cannot set it back to 0
         return false;
     }
-    if (this->bufferSize == 0) {
-        this->buffer = (uint8_t*)malloc(size);
+    if (*bufferSize == 0 || !*owned) {
+        uint8_t* newBuffer = (uint8_t*)malloc(size);
+        if (newBuffer == NULL) {
+            return false;
+        }
+        if (*bufferSize > 0) {
+            memcpy(newBuffer, *buffer, size < *bufferSize ? size : *bufferSize);
+        }
+        *buffer = newBuffer;
+        *owned = true;
     } else {
-        uint8_t* newBuffer = (uint8_t*)realloc(this->buffer, size);
+        uint8_t* newBuffer = (uint8_t*)realloc(*buffer, size);
         if (newBuffer != NULL) {
-            this->buffer = newBuffer;
+            *buffer = newBuffer;
         } else {
             return false;
         }
     }
-    this->bufferSize = size;
-    return (this->buffer != NULL);
+    *bufferSize = size;
+    return true;
 }
 
 uint16_t PubSubClient::getBufferSize() {
-    return this->bufferSize;
+    return this->rxBufferSize;
 }
+PubSubClient& PubSubClient::setInflightWindow(uint8_t window) {
+    if (window < 1) {
+        window = 1;
+    }
+    if (window > MQTT_MAX_INFLIGHT) {
+        window = MQTT_MAX_INFLIGHT;
+    }
+    this->inflightWindow = window;
+    return *this;
+}
+
+uint8_t PubSubClient::getInflight() {
+    return this->inflightCount;
+}
+
 PubSubClient& PubSubClient::setKeepAlive(uint16_t keepAlive) {
     this->keepAlive = keepAlive;
     return *this;
@@ -14,9 +14,11 @@
 
 #define MQTT_VERSION_3_1      3
 #define MQTT_VERSION_3_1_1    4
+#define MQTT_VERSION_5        5
 
 // MQTT_VERSION : Pick the version
 //#define MQTT_VERSION MQTT_VERSION_3_1
+//#define MQTT_VERSION MQTT_VERSION_5
 #ifndef MQTT_VERSION
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
@@ -26,6 +28,14 @@
 #define MQTT_MAX_PACKET_SIZE 256
 #endif
 
+// MQTT_MAX_TX_SIZE : Size of the buffer outgoing packets are built in, by default the same as
+//  MQTT_MAX_PACKET_SIZE. Payloads are written straight from the caller's memory, so it only has
+//  to hold CONNECT, SUBSCRIBE and the header and topic of a PUBLISH; a smaller one saves RAM if
+//  those fit. Override with setBufferSize(rx, tx).
+#ifndef MQTT_MAX_TX_SIZE
+#define MQTT_MAX_TX_SIZE MQTT_MAX_PACKET_SIZE
+#endif
+
 // MQTT_KEEPALIVE : keepAlive interval in Seconds. Override with setKeepAlive()
 #ifndef MQTT_KEEPALIVE
 #define MQTT_KEEPALIVE 15
@@ -36,12 +46,64 @@
 #define MQTT_SOCKET_TIMEOUT 15
 #endif
 
+// MQTT_READ_CHUNK : bytes read from the network client at once when a packet that does not fit
+//  in the buffer is skipped or forwarded to the stream. Taken from the stack.
+#ifndef MQTT_READ_CHUNK
+#define MQTT_READ_CHUNK 32
+#endif
+
 // MQTT_MAX_TRANSFER_SIZE : limit how much data is passed to the network client
 //  in each write call. Needed for the Arduino Wifi Shield. Leave undefined to
 //  pass the entire MQTT packet in each write call.
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
+// MQTT_MAX_INFLIGHT : number of QoS 1 messages that can wait for their PUBACK. The slots are
+//  part of the client object, nothing is allocated at runtime. Override the window with setInflightWindow()
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 4
+#endif
+
+// MQTT_INFLIGHT_SIZE : bytes of topic and payload that fit in an in-flight slot
+#ifndef MQTT_INFLIGHT_SIZE
+#define MQTT_INFLIGHT_SIZE 128
+#endif
+
+// MQTT_MAX_ROUTES : number of trie nodes for topic filters with a + or # wildcard and their own
+//  handler. Every level of such a filter that is not shared with an earlier one takes one node,
+//  a # level takes none. Filters without wildcards take no node.
+#ifndef MQTT_MAX_ROUTES
+#define MQTT_MAX_ROUTES 16
+#endif
+
+// MQTT_MAX_HANDLERS : number of topic filters with their own handler, with or without wildcards
+#ifndef MQTT_MAX_HANDLERS
+#define MQTT_MAX_HANDLERS 8
+#endif
+
+// MQTT_MAX_TOPIC_ALIASES : with MQTT_VERSION_5, number of topic aliases in each direction. A topic
+//  published again is sent as a 2 byte alias, as far as the broker allows.
+#ifndef MQTT_MAX_TOPIC_ALIASES
+#define MQTT_MAX_TOPIC_ALIASES 4
+#endif
+
+// MQTT_ALIAS_TOPIC_SIZE : longest topic, including its terminating zero, that gets an alias
+#ifndef MQTT_ALIAS_TOPIC_SIZE
+#define MQTT_ALIAS_TOPIC_SIZE 32
+#endif
+
+// MQTT_STAGING_LATENCY : default for the longest time in ms bytes wait in the staging buffer
+//  set with setTxStaging() before they are written
+#ifndef MQTT_STAGING_LATENCY
+#define MQTT_STAGING_LATENCY 20
+#endif
+
+// MQTT_RETRY_TIMEOUT : a QoS 1 message without PUBACK is sent again after this many ms
+#ifndef MQTT_RETRY_TIMEOUT
+#define MQTT_RETRY_TIMEOUT 5000
+#endif
+
 // Possible values for client.state()
+#define MQTT_CONNECTING             -5 // CONNECT sent by connectAsync(), waiting for the CONNACK
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -53,6 +115,9 @@
 #define MQTT_CONNECT_BAD_CREDENTIALS 4
 #define MQTT_CONNECT_UNAUTHORIZED    5
 
+// SUBACK return code of a filter the server refused
+#define MQTT_SUBACK_FAILURE          0x80
+
 #define MQTTCONNECT     1 << 4  // Client request to connect to Server
 #define MQTTCONNACK     2 << 4  // Connect Acknowledgment
 #define MQTTPUBLISH     3 << 4  // Publish message
@@ -69,6 +134,8 @@
 #define MQTTDISCONNECT  14 << 4 // Client is Disconnecting
 #define MQTTReserved    15 << 4 // Reserved
 
+#define MQTTDUP         (1 << 3)
+
 #define MQTTQOS0        (0 << 1)
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
@@ -76,37 +143,152 @@
 // Maximum size of fixed header and variable length size header
 #define MQTT_MAX_HEADER_SIZE 5
 
-#if defined(ESP8266) || defined(ESP32)
+// The host build ([env:native]) has std::function too and runs the same code as the ESP8266
+#if defined(ESP8266) || defined(ESP32) || !defined(ARDUINO)
 #include <functional>
 #define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
 #else
 #define MQTT_CALLBACK_SIGNATURE void (*callback)(char*, uint8_t*, unsigned int)
 #endif
 
-#define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->bufferSize) > this->bufferSize) {_client->stop();return false;}
+#if defined(ESP8266) || defined(ESP32) || !defined(ARDUINO)
+typedef std::function<void(char*, uint8_t*, unsigned int)> MQTTHandler;
+typedef std::function<void(char*, uint32_t)> MQTTBeginHandler;
+typedef std::function<void(uint8_t*, unsigned int)> MQTTChunkHandler;
+typedef std::function<void()> MQTTEndHandler;
+typedef std::function<void(uint16_t, uint8_t*, uint8_t)> MQTTSubackHandler;
+typedef std::function<void(uint16_t)> MQTTUnsubackHandler;
+#else
+typedef void (*MQTTHandler)(char*, uint8_t*, unsigned int);
+typedef void (*MQTTBeginHandler)(char*, uint32_t);
+typedef void (*MQTTChunkHandler)(uint8_t*, unsigned int);
+typedef void (*MQTTEndHandler)();
+typedef void (*MQTTSubackHandler)(uint16_t, uint8_t*, uint8_t);
+typedef void (*MQTTUnsubackHandler)(uint16_t);
+#endif
+
+#define CHECK_STRING_LENGTH(l,s) if (l+2+strnlen(s, this->txBufferSize) > this->txBufferSize) {_client->stop();return false;}
+
+// A QoS 1 message waiting for its PUBACK
+struct MQTTInflight {
+   uint16_t msgId;      // 0 once acknowledged
+   uint8_t header;      // Fixed header byte, MQTTDUP is set after the first transmission
+   uint16_t length;     // Bytes used in data
+   unsigned long sent;  // millis() of the last transmission
+   uint8_t data[MQTT_INFLIGHT_SIZE]; // Topic, message id and payload
+};
+
+#define MQTT_NO_ROUTE 0xFF
+
+// One level of a topic filter with wildcards in the routing trie. A node holds no handler itself,
+// only the index of one, so scanning the nodes of a level stays within a few cache lines.
+struct MQTTRoute {
+   const char* level = NULL;       // Points into the filter, which must stay valid
+   uint8_t length = 0;
+   uint8_t child = MQTT_NO_ROUTE;  // First node of the next level with a literal level
+   uint8_t next = MQTT_NO_ROUTE;   // Next node on the same level
+   uint8_t plus = MQTT_NO_ROUTE;   // Node of a + on the next level
+   uint8_t handler = MQTT_NO_ROUTE; // Handler of the filter that ends here
+   uint8_t rest = MQTT_NO_ROUTE;   // Handler of the filter that ends with a # on the next level
+};
+
+// A topic filter without wildcards, which only matches the topic equal to it
+struct MQTTLiteral {
+   const char* filter;  // Must stay valid
+   uint16_t length;
+   uint8_t sum;         // Of the bytes of the filter, compared before the filter itself
+   uint8_t handler;
+};
 
 class PubSubClient : public Print {
 private:
    Client* _client;
-   uint8_t* buffer;
-   uint16_t bufferSize;
+   uint8_t* rxBuffer = NULL;   // Incoming packets, handed to the callback
+   uint8_t* txBuffer = NULL;   // Outgoing packets, so a callback can publish without overwriting its message
+   uint16_t rxBufferSize = 0;
+   uint16_t txBufferSize = 0;
+   bool rxOwned = false;       // Allocated by the client, false for storage given to setBuffers()
+   bool txOwned = false;
+   boolean resizeBuffer(uint8_t** buffer, uint16_t* bufferSize, bool* owned, uint16_t size);
    uint16_t keepAlive;
    uint16_t socketTimeout;
-   uint16_t nextMsgId;
+   uint16_t nextMsgId = 0;
    unsigned long lastOutActivity;
    unsigned long lastInActivity;
    bool pingOutstanding;
    MQTT_CALLBACK_SIGNATURE;
+   // State of the incremental packet reader, kept between calls to loop()
+   uint8_t readStage = 0;
+   uint8_t readLlen = 0;    // Bytes in the remaining length field
+   uint8_t readShift = 0;   // Position of the next remaining length digit
+   uint16_t readLen = 0;    // Bytes of the packet stored in the buffer
+   uint32_t readLength = 0; // Remaining length of the packet
+   uint32_t readIndex = 0;  // Bytes read after the remaining length field
+   uint32_t readSkip = 0;   // Topic and message id bytes that are not forwarded to the stream
+   unsigned long readStart = 0;
+   bool readChunked = false; // The message goes to the chunk handlers
+   uint16_t readMsgId = 0;   // Message id of a chunked QoS 1 message
+   bool readProps = false;   // readSkip ends in the property length, which is still being read
+   uint32_t readPropLength = 0;
+   uint8_t readPropShift = 0;
+   MQTTBeginHandler messageBegin = NULL;
+   MQTTChunkHandler messageChunk = NULL;
+   MQTTEndHandler messageEnd = NULL;
+   MQTTSubackHandler subackHandler = NULL;
+   MQTTUnsubackHandler unsubackHandler = NULL;
    uint32_t readPacket(uint8_t*);
-   boolean readByte(uint8_t * result);
-   boolean readByte(uint8_t * result, uint16_t * index);
+   void forwardPayload(const uint8_t* data, uint32_t count);
+   char* publishTopic(uint8_t llen, uint32_t end, uint32_t* pos, uint16_t* msgId);
+   void beginChunked();
+   void endChunked();
    boolean write(uint8_t header, uint8_t* buf, uint16_t length);
+   boolean writeBytes(const uint8_t* buf, uint32_t length);
+   boolean sendBytes(const uint8_t* buf, uint32_t length);
+   // Optional staging buffer that collects the packets of one loop() pass into one write
+   uint8_t* stageBuffer = NULL;
+   uint16_t stageSize = 0;
+   uint16_t stageUsed = 0;
+   uint16_t stageLatency = MQTT_STAGING_LATENCY;
+   unsigned long stageStart = 0; // millis() when the oldest staged byte was written
+   boolean sendStaged();
+   boolean writePublishHeader(uint8_t header, const char* topic, uint32_t plength);
+   // Ring of QoS 1 messages in order of publishing
+   MQTTInflight inflight[MQTT_MAX_INFLIGHT];
+   uint8_t inflightHead = 0;
+   uint8_t inflightCount = 0;
+   uint8_t inflightWindow = MQTT_MAX_INFLIGHT;
+   boolean sendInflight(MQTTInflight& message);
+   void retryInflight(unsigned long t);
+   void ackInflight(uint16_t msgId);
+   uint16_t newMsgId();
+   // Trie of the topic filters with wildcards, node 0 is the root
+   MQTTRoute routes[MQTT_MAX_ROUTES];
+   uint8_t routeCount = 1;
+   // Topic filters without wildcards, scanned in turn like a callback comparing the topic with
+   // each of them would, but telling most of them apart by length and sum alone
+   MQTTLiteral literals[MQTT_MAX_HANDLERS];
+   uint8_t literalCount = 0;
+   MQTTHandler handlers[MQTT_MAX_HANDLERS];
+   uint8_t handlerCount = 0;
+   boolean setHandler(uint8_t* slot, MQTTHandler handler);
+   boolean dispatch(char* topic, uint8_t* payload, unsigned int length);
+   void deliver(char* topic, uint8_t* payload, unsigned int length);
+#if MQTT_VERSION == MQTT_VERSION_5
+   // Topic aliases of this connection, alias n is entry n-1
+   char aliasIn[MQTT_MAX_TOPIC_ALIASES][MQTT_ALIAS_TOPIC_SIZE];
+   char aliasOut[MQTT_MAX_TOPIC_ALIASES][MQTT_ALIAS_TOPIC_SIZE];
+   uint8_t aliasOutCount = 0;
+   uint16_t aliasOutMax = 0;        // Topic alias maximum of the broker
+   uint16_t serverReceiveMax = 0xFFFF;
+   uint16_t propertyAlias = 0;      // Topic alias of the PUBLISH being read
+   uint32_t readProperties(uint32_t pos, uint32_t end);
+#endif
    uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos);
    // Build up the header ready to send
    // Returns the size of the header
    // Note: the header is built at the end of the first MQTT_MAX_HEADER_SIZE bytes, so will start
    //       (MQTT_MAX_HEADER_SIZE - <returned size>) bytes into the buffer
-   size_t buildHeader(uint8_t header, uint8_t* buf, uint16_t length);
+   size_t buildHeader(uint8_t header, uint8_t* buf, uint32_t length);
    IPAddress ip;
    const char* domain;
    uint16_t port;
@@ -134,12 +316,24 @@ public:
    PubSubClient& setServer(uint8_t * ip, uint16_t port);
    PubSubClient& setServer(const char * domain, uint16_t port);
    PubSubClient& setCallback(MQTT_CALLBACK_SIGNATURE);
+   // Messages larger than the receive buffer are delivered in pieces instead of being dropped:
+   // begin with the topic and the payload length, chunk for every piece of payload as it is read
+   // from the network client, end when the message is complete. The chunk handler enables this.
+   PubSubClient& onMessageBegin(MQTTBeginHandler handler);
+   PubSubClient& onMessageChunk(MQTTChunkHandler handler);
+   PubSubClient& onMessageEnd(MQTTEndHandler handler);
    PubSubClient& setClient(Client& client);
    PubSubClient& setStream(Stream& stream);
    PubSubClient& setKeepAlive(uint16_t keepAlive);
    PubSubClient& setSocketTimeout(uint16_t timeout);
 
+   // Sets the size of both the receive and the transmit buffer
    boolean setBufferSize(uint16_t size);
+   boolean setBufferSize(uint16_t rxSize, uint16_t txSize);
+   // Uses storage of the caller, for instance static arrays, instead of allocated buffers. The
+   // storage must stay valid. Returns 0 if a buffer is missing or the transmit buffer is too small
+   boolean setBuffers(uint8_t* rx, uint16_t rxSize, uint8_t* tx, uint16_t txSize);
+   // Returns the size of the receive buffer
    uint16_t getBufferSize();
 
    boolean connect(const char* id);
@@ -147,11 +341,29 @@ public:
    boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
    boolean connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Start to connect without waiting for the server.
+   // This API:
+   //   connectAsync(...)
+   //   poll() or loop() until state() is no longer MQTT_CONNECTING
+   // Opens the network connection and sends CONNECT. The CONNACK is read by poll() once it has
+   // arrived, so loop() is never blocked for up to socketTimeout.
+   // Returns 1 if CONNECT was sent (or the client is already connected), 0 if there was an error
+   boolean connectAsync(const char* id);
+   boolean connectAsync(const char* id, const char* user, const char* pass);
+   boolean connectAsync(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage, boolean cleanSession);
+   // Reads the CONNACK when it has arrived, or times out after socketTimeout
+   // Returns state(): MQTT_CONNECTING while waiting, MQTT_CONNECTED or an error code when done
+   int poll();
    void disconnect();
    boolean publish(const char* topic, const char* payload);
    boolean publish(const char* topic, const char* payload, boolean retained);
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength);
    boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
+   // Publish at QoS 0 or 1. A QoS 1 message is kept until the server acknowledges it and is sent
+   // again with DUP after MQTT_RETRY_TIMEOUT or a reconnect. It can be published while disconnected.
+   // Returns 0 if the in-flight window is full or the message does not fit in MQTT_INFLIGHT_SIZE
+   boolean publish(const char* topic, const char* payload, boolean retained, uint8_t qos);
+   boolean publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, uint8_t qos);
    boolean publish_P(const char* topic, const char* payload, boolean retained);
    boolean publish_P(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained);
    // Start to publish a message.
@@ -171,9 +383,38 @@ public:
    // Write size bytes from buffer into the payload (only to be used with beginPublish/endPublish)
    // Returns the number of bytes written
    virtual size_t write(const uint8_t *buffer, size_t size);
+   // Collects outgoing packets in storage of the caller and writes them to the network client in
+   // one call at the end of loop(), when storage is full or when the oldest byte has waited
+   // maxLatency ms. Pass NULL to write every packet right away again (the default).
+   PubSubClient& setTxStaging(uint8_t* storage, uint16_t size, uint16_t maxLatency = MQTT_STAGING_LATENCY);
+   // Writes the staged packets now. If they cannot be written the connection is closed, see state()
+   virtual void flush();
+   // Same as flush(), returns false if the staged packets could not be written
+   boolean flushStaged();
+   // Number of QoS 1 messages that may wait for a PUBACK at the same time, 1 to MQTT_MAX_INFLIGHT
+   PubSubClient& setInflightWindow(uint8_t window);
+   // Returns the number of QoS 1 messages waiting for a PUBACK
+   uint8_t getInflight();
    boolean subscribe(const char* topic);
    boolean subscribe(const char* topic, uint8_t qos);
+   // Calls handler for every message whose topic matches filter, which may contain the + and #
+   // wildcards. The filter string must stay valid. Messages that match no filter go to the callback.
+   // Returns 0 if MQTT_MAX_ROUTES or MQTT_MAX_HANDLERS is too small, or a # is not the last level
+   boolean addRoute(const char* filter, MQTTHandler handler);
+   // addRoute() and subscribe() in one
+   boolean subscribe(const char* filter, MQTTHandler handler, uint8_t qos = 0);
+   // Subscribe to count filters in one SUBSCRIBE packet, qos may be NULL for QoS 0 on all of them
+   // Returns the message id of the packet, which the SUBACK reports, or 0 if it could not be sent
+   uint16_t subscribe(const char* filters[], const uint8_t qos[], uint8_t count);
    boolean unsubscribe(const char* topic);
+   // Unsubscribe from count filters in one UNSUBSCRIBE packet
+   // Returns the message id of the packet, which the UNSUBACK reports, or 0 if it could not be sent
+   uint16_t unsubscribe(const char* filters[], uint8_t count);
+   // Called from loop() for every SUBACK with the message id of the SUBSCRIBE and the return code
+   // of each filter: the granted QoS, or 0x80 if the subscription failed
+   PubSubClient& onSuback(MQTTSubackHandler handler);
+   // Called from loop() for every UNSUBACK with the message id of the UNSUBSCRIBE
+   PubSubClient& onUnsuback(MQTTUnsubackHandler handler);
    boolean loop();
    boolean connected();
    int state();
@@ -0,0 +1,173 @@
+/** @file
+ * Queue of MQTT messages in flash, for publishing while the connection is down.
+ */
+
+#include <string.h>
+#include "Spool.h"
+#if defined(ARDUINO)
+#include <LittleFS.h>
+#endif
+
+#define SPOOL_HEADER_SIZE 8
+#define SPOOL_SLOT_OFFSET (SPOOL_CHECKPOINTS * SPOOL_HEADER_SIZE)
+
+// CRC-16/CCITT, bit by bit; a record is at most SPOOL_SLOT_SIZE bytes
+static uint16_t spoolCrc(uint16_t crc, const uint8_t* data, uint16_t length) {
+  while (length--) {
+    crc ^= (uint16_t)*data++ << 8;
+    for (uint8_t i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+static uint32_t slotOffset(uint32_t seq) {
+  return SPOOL_SLOT_OFFSET + (seq % SPOOL_SLOTS) * SPOOL_SLOT_SIZE;
+}
+
+bool Spool::begin(const char* path) {
+  static_assert(sizeof(Header) == SPOOL_HEADER_SIZE, "records start with an 8 byte header");
+#if defined(ARDUINO)
+  file = LittleFS.open(path, LittleFS.exists(path) ? "r+" : "w+");
+  if (!file) return false;
+#else
+  if (file) fclose(file);
+  file = fopen(path, "r+b");
+  if (!file) file = fopen(path, "w+b");
+  if (!file) return false;
+#endif
+  counters = SpoolStats{};
+  unsynced = 0;
+  // The newest checkpoint holds the last message that was sent
+  uint32_t drained = 0;
+  checkpointSlot = 0;
+  for (uint8_t i = 0; i < SPOOL_CHECKPOINTS; i++) {
+    Header h;
+    if (!read(i * SPOOL_HEADER_SIZE, (uint8_t*)&h, sizeof(h)) || h.seq == 0 || h.length != 0) continue;
+    uint16_t crc = h.crc;
+    h.crc = 0;
+    if (spoolCrc(0xFFFF, (uint8_t*)&h, sizeof(h)) != crc || h.seq <= drained) continue;
+    drained = h.seq;
+    checkpointSlot = (i + 1) % SPOOL_CHECKPOINTS;
+  }
+  // The newest valid record ends the queue
+  head = 1;
+  for (uint32_t i = 0; i < SPOOL_SLOTS; i++) {
+    Header h;
+    if (!read(slotOffset(i), (uint8_t*)&h, sizeof(h)) || h.seq == 0 || h.seq % SPOOL_SLOTS != i) continue;
+    if (h.seq >= head && readSlot(h.seq)) head = h.seq + 1;
+  }
+  if (head <= drained) head = drained + 1; // The records after the checkpoint were lost
+  tail = drained + 1;
+  if (head - tail > SPOOL_SLOTS) tail = head - SPOOL_SLOTS;
+  return true;
+}
+
+bool Spool::push(const char* topic, const uint8_t* payload, uint16_t length) {
+  if (!file) return false;
+  size_t topicLength = strlen(topic) + 1;
+  if (SPOOL_HEADER_SIZE + topicLength + length > SPOOL_SLOT_SIZE) return false;
+  Header h{head, (uint16_t)(topicLength + length), 0};
+  memcpy(slot + SPOOL_HEADER_SIZE, topic, topicLength);
+  memcpy(slot + SPOOL_HEADER_SIZE + topicLength, payload, length);
+  memcpy(slot, &h, sizeof(h));
+  h.crc = spoolCrc(0xFFFF, slot, SPOOL_HEADER_SIZE + h.length);
+  memcpy(slot, &h, sizeof(h));
+  // The whole record in one write, a power loss leaves at most this record torn
+  if (!write(slotOffset(head), slot, SPOOL_HEADER_SIZE + h.length)) return false;
+  if (head - tail == SPOOL_SLOTS) {
+    tail++; // Full, the oldest message was just overwritten
+    counters.dropped++;
+  }
+  head++;
+  counters.pushed++;
+  counters.messageBytes += h.length - 1;
+  if (++unsynced >= SPOOL_SYNC) sync();
+  return true;
+}
+
+uint16_t Spool::drain(SpoolSender send, uint16_t max) {
+  if (!file) return 0;
+  uint16_t sent = 0;
+  uint32_t start = tail;
+  while (sent < max && tail != head) {
+    if (!readSlot(tail)) {
+      counters.corrupt++;
+      tail++;
+      continue;
+    }
+    Header* h = (Header*)slot;
+    const char* topic = (const char*)slot + SPOOL_HEADER_SIZE;
+    size_t topicLength = strnlen(topic, h->length) + 1;
+    if (topicLength > h->length || !send(topic, slot + SPOOL_HEADER_SIZE + topicLength, h->length - topicLength)) break;
+    tail++;
+    sent++;
+  }
+  counters.drained += sent;
+  // One checkpoint for the whole batch
+  if (tail != start) writeCheckpoint(tail - 1);
+  return sent;
+}
+
+uint32_t Spool::size() {
+  return head - tail;
+}
+
+bool Spool::sync() {
+  if (!file) return false;
+  unsynced = 0;
+  counters.fileSyncs++;
+#if defined(ARDUINO)
+  file.flush();
+  return true;
+#else
+  return fflush(file) == 0;
+#endif
+}
+
+SpoolStats Spool::stats() {
+  return counters;
+}
+
+// Reads the record with sequence number seq into slot, false if it is missing or damaged
+bool Spool::readSlot(uint32_t seq) {
+  Header h;
+  if (!read(slotOffset(seq), slot, SPOOL_HEADER_SIZE)) return false;
+  memcpy(&h, slot, sizeof(h));
+  if (h.seq != seq || h.length == 0 || h.length > SPOOL_SLOT_SIZE - SPOOL_HEADER_SIZE) return false;
+  if (!read(slotOffset(seq) + SPOOL_HEADER_SIZE, slot + SPOOL_HEADER_SIZE, h.length)) return false;
+  uint16_t crc = h.crc;
+  h.crc = 0;
+  memcpy(slot, &h, sizeof(h));
+  bool valid = spoolCrc(0xFFFF, slot, SPOOL_HEADER_SIZE + h.length) == crc;
+  h.crc = crc;
+  memcpy(slot, &h, sizeof(h));
+  return valid;
+}
+
+bool Spool::writeCheckpoint(uint32_t drained) {
+  Header h{drained, 0, 0};
+  h.crc = spoolCrc(0xFFFF, (uint8_t*)&h, sizeof(h));
+  if (!write(checkpointSlot * SPOOL_HEADER_SIZE, (uint8_t*)&h, sizeof(h))) return false;
+  checkpointSlot = (checkpointSlot + 1) % SPOOL_CHECKPOINTS;
+  return sync(); // The checkpoint and the records pushed before it in one commit
+}
+
+bool Spool::read(uint32_t offset, uint8_t* data, uint16_t length) {
+  if (!file) return false;
+#if defined(ARDUINO)
+  return file.seek(offset, fs::SeekSet) && (size_t)file.read(data, length) == length;
+#else
+  return fseek(file, offset, SEEK_SET) == 0 && fread(data, 1, length, file) == length;
+#endif
+}
+
+bool Spool::write(uint32_t offset, const uint8_t* data, uint16_t length) {
+  if (!file) return false;
+  counters.fileBytes += length;
+  counters.fileWrites++;
+#if defined(ARDUINO)
+  return file.seek(offset, fs::SeekSet) && (size_t)file.write(data, length) == length;
+#else
+  return fseek(file, offset, SEEK_SET) == 0 && fwrite(data, 1, length, file) == length;
+#endif
+}
@@ -0,0 +1,158 @@
+/** @file
+ * Queue of MQTT messages in flash, for publishing while the connection is down.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <functional>
+
+#if defined(ARDUINO)
+#include <FS.h>
+#else
+#include <cstdio>
+#endif
+
+/**
+ * Bytes of flash per message, the record header included. A message needs its topic, a zero byte
+ * and its payload to fit in SPOOL_SLOT_SIZE - 8 bytes.
+ */
+#ifndef SPOOL_SLOT_SIZE
+#define SPOOL_SLOT_SIZE 128
+#endif
+
+/**
+ * Number of messages the spool holds. When it is full the oldest message is overwritten.
+ */
+#ifndef SPOOL_SLOTS
+#define SPOOL_SLOTS 64
+#endif
+
+/**
+ * Number of checkpoint records. The checkpoint is written to the next one every time, so one torn
+ * by a power loss leaves the previous ones intact.
+ */
+#define SPOOL_CHECKPOINTS 8
+
+/**
+ * Default for the number of messages sent by one call to drain().
+ */
+#ifndef SPOOL_BATCH
+#define SPOOL_BATCH 8
+#endif
+
+/**
+ * Messages pushed between two flushes of the file. Every flush makes LittleFS commit the block the
+ * records went to and its metadata, so flushing once per record programs a block of flash per
+ * message. A power loss loses the messages pushed since the last flush, at most SPOOL_SYNC - 1.
+ */
+#ifndef SPOOL_SYNC
+#define SPOOL_SYNC 8
+#endif
+
+/**
+ * Counters of a spool since begin(). The write counters are what the spool hands to the file
+ * system, not what reaches the flash: LittleFS programs whole pages and, at every flush, rewrites
+ * the block the writes landed in plus its metadata, so the flash traffic follows fileSyncs.
+ */
+struct SpoolStats {
+  uint32_t pushed;       // Messages stored
+  uint32_t drained;      // Messages sent by drain()
+  uint32_t dropped;      // Messages overwritten because the spool was full
+  uint32_t corrupt;      // Records skipped because their CRC or sequence number was wrong
+  uint32_t messageBytes; // Bytes of topic and payload stored
+  uint32_t fileBytes;    // Bytes written to the file, records and checkpoints
+  uint32_t fileWrites;   // Write calls on the file
+  uint32_t fileSyncs;    // Flushes of the file, each one a commit of LittleFS
+};
+
+/**
+ * Sends one spooled message.
+ *
+ * @return false if the message could not be sent, it stays in the spool.
+ */
+typedef std::function<bool(const char* topic, const uint8_t* payload, uint16_t length)> SpoolSender;
+
+/**
+ * A bounded, append-only ring of messages in one file.
+ *
+ * The file holds SPOOL_CHECKPOINTS checkpoint records followed by SPOOL_SLOTS message slots. Every
+ * message gets the next sequence number and is written in one piece to slot sequence % SPOOL_SLOTS,
+ * so the file keeps its size and nothing is truncated, erased or renamed. Messages are never
+ * removed: after every drain() the sequence number of the last message sent is written to the next
+ * checkpoint record. The file is flushed after every checkpoint and every SPOOL_SYNC messages pushed.
+ * begin() finds the newest message and the newest checkpoint after a restart.
+ * Every record carries a CRC, so a record that was torn by a power loss is skipped.
+ *
+ * Rotating through the slots does not spread the wear of the flash itself. LittleFS is
+ * copy-on-write: overwriting part of the file writes the changed block to a free block, so where
+ * the bytes land in flash, and how evenly blocks wear, is up to the wear levelling of LittleFS.
+ *
+ * The RAM used is one slot buffer and a few counters, however many messages are waiting. On the
+ * target the file is on LittleFS, on the host it is a regular file.
+ */
+class Spool {
+  public:
+    /**
+     * Opens the spool, creating the file if it does not exist, and finds the waiting messages.
+     * On the target LittleFS must have been mounted.
+     *
+     * @param path file name.
+     * @return false if the file cannot be opened.
+     */
+    bool begin(const char* path);
+
+    /**
+     * Stores a message at the end of the spool.
+     *
+     * @return false if the message does not fit in a slot, cannot be written or begin() failed.
+     */
+    bool push(const char* topic, const uint8_t* payload, uint16_t length);
+
+    /**
+     * Sends the oldest messages, in order, until max are sent or send() fails.
+     *
+     * @return number of messages sent, 0 if begin() failed.
+     */
+    uint16_t drain(SpoolSender send, uint16_t max = SPOOL_BATCH);
+
+    /**
+     * @return number of messages waiting.
+     */
+    uint32_t size();
+
+    /**
+     * Flushes the messages pushed since the last flush to the file. push() and drain() do it on
+     * their own, call it before a planned restart.
+     *
+     * @return false if the file cannot be flushed or begin() failed.
+     */
+    bool sync();
+
+    /**
+     * @return the counters since begin().
+     */
+    SpoolStats stats();
+
+  private:
+    struct Header {
+      uint32_t seq;    // Sequence number, 0 in an empty slot. In a checkpoint the last message sent
+      uint16_t length; // Bytes of topic, zero byte and payload, 0 in a checkpoint
+      uint16_t crc;    // Over the header with crc 0 and the data
+    };
+#if defined(ARDUINO)
+    fs::File file;
+#else
+    FILE* file{nullptr};
+#endif
+    uint32_t head{1};          // Sequence number of the next message
+    uint32_t tail{1};          // Sequence number of the oldest waiting message
+    uint8_t checkpointSlot{0}; // Checkpoint record written next
+    uint8_t unsynced{0};       // Messages pushed since the last flush
+    SpoolStats counters{};
+    uint8_t slot[SPOOL_SLOT_SIZE];
+    bool readSlot(uint32_t seq);
+    bool writeCheckpoint(uint32_t drained);
+    bool read(uint32_t offset, uint8_t* data, uint16_t length);
+    bool write(uint32_t offset, const uint8_t* data, uint16_t length);
+};
@@ -4,41 +4,112 @@
  * Adapted from the original from 2015 Circuitar
  */
 
-#include "Arduino.h"
+#include "Hal.h"
 #include "Dimmer.h"
 
 // Dimmer registry
 static Dimmer* dimmers[DIMMER_MAX_TRIAC]{nullptr};     // Pointers to all registered dimmer objects
 static uint8_t dimmerCount{0};                // Number of registered dimmer objects
+static uint32_t gateMask{0};                  // Triac pins of all registered dimmers, bit n is GPIO n
 
 // Global state variables
 bool Dimmer::started{false}; // At least one dimmer has started
-static volatile uint32_t sincelastCrossing{0}; // Record how many micros have passed since last Zero Crossing detection, used for debouncing zero crossing circuit and to calculate when triac needs to be fired.
-static bool zerocrossiscalled{false}; // If zerocross is detected and handled the first time we should not handle again till next crossing
+static ZeroCrossTracker tracker; // Measures mains period and phase, debounces the zero cross circuit
+static int16_t zeroCrossOffset{0}; // Delay of the zero cross circuit, @see Dimmer::setZeroCrossOffset()
+static bool timerUsed{false}; // At least one dimmer runs in DIMMER_TIMER mode
+static DimmerStats isrStats{}; // Written by the interrupt service routines only
 
-// Zero cross interrupt
-void ICACHE_RAM_ATTR callZeroCross() {
-  if(micros() - sincelastCrossing > 5000) {// It can not be a bounce because of the amount of time passed, this must be the first time
-    zerocrossiscalled = false;
-    sincelastCrossing = micros();  }
-  if(zerocrossiscalled) return; // If we have run this IRS before it must be a bounce
-  zerocrossiscalled = true; // Remember that we have run this ISR before
+// Firing schedule of the DIMMER_TIMER channels for the current half cycle, sorted by firing time.
+// Channels firing at the same time share one entry and are written with one port write.
+struct FiringEvent {
+  uint16_t time; // Firing delay after the zero crossing, in us
+  uint32_t mask; // Triac pins to fire, bit n is GPIO n
+};
+static FiringEvent schedule[DIMMER_MAX_TRIAC];
+static uint8_t scheduleCount{0}; // Number of events in this half cycle
+static uint8_t scheduleNext{0};  // Next event to fire
+static uint32_t scheduleStart{0}; // micros() at the zero crossing
+
+// Adds a channel to the schedule, keeping it sorted (insertion sort, DIMMER_MAX_TRIAC is small)
+static void ICACHE_RAM_ATTR scheduleFiring(uint16_t time, uint32_t mask) {
+  uint8_t i = scheduleCount;
+  while (i > 0 && schedule[i-1].time > time) i--;
+  if (i > 0 && time - schedule[i-1].time < DIMMER_FIRING_MERGE) {
+    schedule[i-1].mask |= mask;
+    return;
+  }
+  if (i < scheduleCount && schedule[i].time - time < DIMMER_FIRING_MERGE) {
+    schedule[i].mask |= mask;
+    schedule[i].time = time;
+    return;
+  }
+  for (uint8_t j = scheduleCount; j > i; j--) schedule[j] = schedule[j-1];
+  schedule[i] = {time, mask};
+  scheduleCount++;
+}
+
+// Fires all events that are due and arms the timer for the next one. When all have fired, the
+// timer is armed a little after the predicted next crossing, to carry on if that edge is missed.
+static void ICACHE_RAM_ATTR runSchedule() {
+  while (scheduleNext < scheduleCount) {
+    int32_t elapsed = micros() - scheduleStart; // Negative when the filtered crossing is still to come
+    if (schedule[scheduleNext].time > elapsed) {
+      halTimerArm(schedule[scheduleNext].time - elapsed);
+      return;
+    }
+    halWritePins(schedule[scheduleNext].mask, TRIAC_NORMAL_STATE);
+    DIMMER_STAT_LATENCY(isrStats, elapsed - schedule[scheduleNext].time);
+    scheduleNext++;
+  }
+  if (timerUsed && tracker.locked()) {
+    int32_t wait = tracker.next() + tracker.period() / 8 - micros();
+    halTimerArm(wait > 0 ? wait : 1);
+  }
+}
+
+// Starts a half cycle at the crossing known by the tracker
+void ICACHE_RAM_ATTR startHalfCycle() {
+  // Start a new firing schedule, anything left from the previous half cycle is dropped
+  halTimerDisarm();
+  scheduleStart = tracker.crossing() - zeroCrossOffset;
+  scheduleCount = 0;
+  scheduleNext = 0;
+  halWritePins(gateMask, !TRIAC_NORMAL_STATE); // Reset the triac gates of all dimmers with one port write
   // Process each registered dimmer object
   for (uint8_t i = 0; i < dimmerCount; i++) {
     dimmers[i]->zeroCross();
   }
+  runSchedule();
+}
+
+// Zero cross interrupt
+void ICACHE_RAM_ATTR callZeroCross() {
+  DIMMER_STAT_INC(isrStats.edges);
+  if (!tracker.edge(micros())) { // A bounce of the zero cross circuit
+    DIMMER_STAT_INC(isrStats.bounces);
+    return;
+  }
+  startHalfCycle();
+}
+
+// One-shot timer interrupt
+void ICACHE_RAM_ATTR callTimer() {
+  if (scheduleNext < scheduleCount) runSchedule();
+  else if (tracker.predict()) startHalfCycle(); // The edge of this crossing was missed
 }
 
 // Constructor
 Dimmer::Dimmer(uint8_t pin, uint8_t mode, double rampTime, uint8_t freq) :
   triacPin(pin),
   operatingMode(mode),
-  acFreq(freq)
+  acFreq(freq),
+  curve(dimmerCurves[DIMMER_CURVE_LINEAR].delay)
  {
     if (dimmerCount < DIMMER_MAX_TRIAC) {
       // Register dimmer object being created
       dimmerIndex = dimmerCount;
       dimmers[dimmerCount++] = this;
+      gateMask |= 1UL << pin;
       }
     setRampTime(rampTime);
     // Initialize triac pin
@@ -52,23 +123,23 @@ void Dimmer::begin(uint8_t value) {
   set(value);
   if (!started) {
     // Start zero cross circuit if not started yet
+    tracker.begin(acFreq);
     pinMode(DIMMER_ZERO_CROSS_PIN, INPUT);
     enableinterrupt();
     started = true;
   }
-  halfcycletime = 500000 / acFreq; // 1sec/freq/2 = 1000000usec/2/ freq
+  if (operatingMode == DIMMER_TIMER) {
+    halTimerAttach(callTimer);
+    timerUsed = true;
+  }
 }
 
 void Dimmer::off() {
-  rampCounter = 0;
-  rampEndValue = minValue;
-  rampStartValue = maxValue;
+  applyNow(DIMMER_COMMAND_OFF);
   }
 
 void Dimmer::on() {
-  rampCounter = 0;
-  rampEndValue = maxValue;
-  rampStartValue = minValue;
+  applyNow(DIMMER_COMMAND_ON);
   }
   
 void Dimmer::toggle() {
@@ -84,21 +155,93 @@ uint8_t Dimmer::value() {
   return lampValue;
 }
 
-uint8_t Dimmer::getValue() {
-  if (rampStartValue < rampEndValue) return rampStartValue + ((int32_t) rampEndValue - rampStartValue) * ((float)rampCounter / rampCycles);
-  return rampStartValue - ((int32_t) rampStartValue - rampEndValue) * ((float)rampCounter / rampCycles);
+uint8_t Dimmer::target() {
+  return rampEndValue;
+}
+
+uint8_t ICACHE_RAM_ATTR Dimmer::getValue() {
+  return (rampValue + 0x8000) >> 16;
+  }
+
+// The division is done here, from loop(), the zero cross interrupt only adds rampStep. A lamp
+// value starts from the current brightness, unrounded: nothing steps the ramp between post() and
+// the zero crossing that applies the command.
+Dimmer::Ramp Dimmer::plan(uint8_t command) {
+  Ramp ramp;
+  if (command == DIMMER_COMMAND_OFF) {
+    ramp.from = (int32_t)maxValue << 16;
+    ramp.to = minValue;
+    }
+  else if (command == DIMMER_COMMAND_ON) {
+    ramp.from = (int32_t)minValue << 16;
+    ramp.to = maxValue;
+    }
+  else {
+    ramp.from = rampValue;
+    ramp.to = command < minValue ? minValue : command;
+    }
+  ramp.step = (((int32_t)ramp.to << 16) - ramp.from) / rampCycles;
+  return ramp;
   }
 
 void Dimmer::set(uint8_t value) {
-  if (value > 100) value = 100;
-  if (value < minValue) value = minValue;
-  rampStartValue = getValue(); // We start from the current brightness
-  maxValue = value; // We have a new max value
-  rampEndValue = maxValue; // We should end with the new maxvalue
-  rampCounter = 0;
-  if (operatingMode == DIMMER_COUNT) {
-    pulseCount = 0;
+  applyNow(value > 100 ? 100 : value);
+  }
+
+void ICACHE_RAM_ATTR Dimmer::apply(uint8_t command, const Ramp& ramp) {
+  if (command == DIMMER_COMMAND_OFF || command == DIMMER_COMMAND_ON) rampValue = ramp.from;
+  else {
+    maxValue = ramp.to; // We have a new max value
+    if (operatingMode == DIMMER_COUNT) {
+      pulseCount = 0;
+      }
     }
+  rampStep = ramp.step;
+  rampEndValue = ramp.to;
+  rampCounter = rampCycles;
+  }
+
+// zeroCross() steps the same ramp, so loop() changes it with the interrupts off. A posted command
+// still waiting in the mailbox is older than this one, it is dropped and counted as coalesced.
+void Dimmer::applyNow(uint8_t command) {
+  noInterrupts();
+  pendingCommand = DIMMER_COMMAND_NONE;
+  apply(command, plan(command));
+  interrupts();
+  }
+
+// The command and its ramp are written with the interrupts off, so zeroCross() never takes the
+// ramp of one command with another
+void Dimmer::post(uint8_t value) {
+  postedCount++;
+  uint8_t command = value > 100 ? 100 : value;
+  Ramp ramp = plan(command);
+  noInterrupts();
+  pendingRamp = ramp;
+  pendingCommand = command; // Replaces a command that is still waiting
+  interrupts();
+  }
+
+void Dimmer::postOff() {
+  postedCount++;
+  Ramp ramp = plan(DIMMER_COMMAND_OFF);
+  noInterrupts();
+  pendingRamp = ramp;
+  pendingCommand = DIMMER_COMMAND_OFF;
+  interrupts();
+  }
+
+DimmerCommands Dimmer::commands() {
+  DimmerCommands copy;
+  bool waiting;
+  do {
+    copy.applied = appliedCount;
+    waiting = pendingCommand != DIMMER_COMMAND_NONE;
+  } while (copy.applied != appliedCount); // A zero crossing took the command while reading
+  copy.posted = postedCount;
+  // Every command posted is applied, replaced or still waiting
+  copy.coalesced = copy.posted - copy.applied - waiting;
+  return copy;
   }
 
 void Dimmer::setMinimum(uint8_t value) {
@@ -111,18 +254,43 @@ void Dimmer::setMinimum(uint8_t value) {
     }
   }
 
+void Dimmer::setZeroCrossOffset(int16_t offset) {
+  zeroCrossOffset = offset;
+  }
+
+ZeroCrossTracker& Dimmer::mains() {
+  return tracker;
+  }
+
+DimmerStats Dimmer::stats() {
+  noInterrupts(); // Both interrupt service routines write the counters, copy them in one piece
+  DimmerStats copy = isrStats;
+  interrupts();
+  copy.missed = tracker.missed();
+  return copy;
+  }
+
+void Dimmer::setCurve(uint8_t curve) {
+  if (curve >= DIMMER_CURVES) return;
+  this->curve = dimmerCurves[curve].delay;
+  }
+
 void Dimmer::setRampTime(double rampTime) {
   rampTime = rampTime * 2 * acFreq + 1;  // = keren dat de zero crossing in tijd moet worden doorlopen
   rampCycles = rampTime > 0xFFFF ? 0xFFFF : rampTime;
-  rampCounter = 0;
   }
 
 void Dimmer::update() {
   pwmtimer->update();
   }
 
-void Dimmer::zeroCross() {
-  digitalWrite(triacPin, !TRIAC_NORMAL_STATE); // Reset Triac gate
+void ICACHE_RAM_ATTR Dimmer::zeroCross() {
+  uint8_t command = pendingCommand;
+  if (command != DIMMER_COMMAND_NONE) { // The newest command posted since the last zero crossing
+    pendingCommand = DIMMER_COMMAND_NONE;
+    appliedCount++;
+    apply(command, pendingRamp);
+  }
   lampValue = getValue();
   if (operatingMode == DIMMER_COUNT) {
     /* Dimmer Count mode Use count mode to switch the load on and off only when the AC voltage crosses zero. In this
@@ -132,7 +300,7 @@ void Dimmer::zeroCross() {
       * any triac switching noise on the line.
       */
     zcCounter++;
-    if (lampValue > ((float)pulseCount*100 / zcCounter)) {
+    if ((uint32_t)lampValue * zcCounter > (uint32_t)pulseCount * 100) { // lampValue > pulseCount*100/zcCounter
       // Turn dimmer on at zero crossing time
       callTriac();
       pulseCount++;
@@ -142,22 +310,36 @@ void Dimmer::zeroCross() {
       pulseCount = 0;
     }
   }
+  else if (operatingMode == DIMMER_TIMER) {
+    triacTime = ((uint32_t)curve[lampValue] * tracker.period()) >> 16; // Wait time before triggering the Triac
+    if (lampValue) scheduleFiring(triacTime, 1UL << triacPin); // Fired by runSchedule() from the timer interrupt
+  }
   else {
     pwmtimer->stop();  
-    triacTime = halfcycletime-(lampValue*halfcycletime/100); // Wait time before triggering the Triac
+    triacTime = ((uint32_t)curve[lampValue] * tracker.period()) >> 16; // Wait time before triggering the Triac
     pwmtimer->interval(triacTime);
     pwmtimer->start();
   }
-  // Increment the ramp counter until it reaches the total number of cycles for the ramp
-  if (rampCounter < rampCycles) rampCounter++;
+  // Step the ramp until it reaches the end value, landing exactly on it
+  if (rampCounter) {
+    if (--rampCounter) rampValue += rampStep;
+    else rampValue = (int32_t)rampEndValue << 16;
+  }
 }
 
-void Dimmer::callTriac() {
+void ICACHE_RAM_ATTR Dimmer::callTriac() {
   digitalWrite(triacPin, TRIAC_NORMAL_STATE);
+#if DIMMER_STATS
+  if (operatingMode == DIMMER_NORMAL) { // Called from loop() by pwmtimer, see how late we are
+    int32_t late = micros() - scheduleStart - triacTime;
+    DIMMER_STAT_LATENCY(isrStats, late > 0 ? late : 0);
+  }
+#endif
   }
 
 void Dimmer::disableinterrupt(){
   detachInterrupt(digitalPinToInterrupt(DIMMER_ZERO_CROSS_PIN));
+  halTimerDisarm();
 }
 
 void Dimmer::enableinterrupt(){
@@ -8,10 +8,15 @@
 #pragma once
 
 #include "Ticker.h"
+#include "DimmerCurve.h"
+#include "ZeroCross.h"
+#include "DimmerStats.h"
 /**
  * Maximum number of triacs that can be used. Can be decreased to save RAM.
  */
+#ifndef DIMMER_MAX_TRIAC
 #define DIMMER_MAX_TRIAC 1
+#endif
 
 /**
  * Triac control is either high (HIGH) or low (LOW) to turn Triac off, depends on hardware setup 
@@ -27,11 +32,36 @@
  */
 #define DIMMER_ZERO_CROSS_PIN 4
 
+/**
+ * DIMMER_TIMER channels whose firing times are less than this many microseconds apart are fired
+ * together with one port write, saving a timer interrupt.
+ */
+#ifndef DIMMER_FIRING_MERGE
+#define DIMMER_FIRING_MERGE 8
+#endif
+
 /**
  * Possible operating modes for the dimmer library.
  */
 #define DIMMER_NORMAL 0
 #define DIMMER_COUNT  1
+#define DIMMER_TIMER  2
+
+/**
+ * Values of the command mailbox of a dimmer besides a lamp value of 0 to 100. @see Dimmer::post()
+ */
+#define DIMMER_COMMAND_NONE 0xFF
+#define DIMMER_COMMAND_OFF  0xFE
+#define DIMMER_COMMAND_ON   0xFD
+
+/**
+ * Counters of the commands posted to one dimmer. @see Dimmer::commands()
+ */
+struct DimmerCommands {
+  uint32_t posted;    // Calls to post() and postOff()
+  uint32_t applied;   // Commands taken by a zero crossing
+  uint32_t coalesced; // Commands replaced by a newer one before the next zero crossing
+};
 
 /**
  * A dimmer channel.
@@ -49,8 +79,9 @@ class Dimmer {
      *          Possible modes:
      *          DIMMER_NORMAL: Uses timer to apply only a percentage of the AC power to the lamp every half cycle. It applies a ramp effect when changing levels and time is bigger than 0 @see rampTime @see setRampTime().
      *          DIMMER_COUNT: Counts AC waves and applies full half cycles from time to time.
+     *          DIMMER_TIMER: As DIMMER_NORMAL, but the triac is fired from the one-shot hardware timer (see Hal.h) instead of a Ticker polled from loop(). All DIMMER_TIMER channels share the timer: every half cycle they are sorted by firing time and the timer is re-armed from one firing to the next. Triac pins must be GPIO 0 to 16.
      * @param rampTime time it takes for the value to rise from 0% to 100% in RAMP_MODE, in seconds. Default 1.5. 
-     * @param freq AC frequency, in Hz (default 50Hz or 60Hz). Others not tested, so use other values with caution.
+     * @param freq AC frequency, in Hz (default 50Hz or 60Hz). Used until the actual frequency has been measured from the zero cross circuit, @see mains().
      *
      * @see begin()
      */
@@ -67,7 +98,9 @@ class Dimmer {
     void begin(uint8_t value = 0);
 
     /**
-     * Turns the lamp OFF.
+     * Turns the lamp OFF. Like on(), toggle() and set(), this starts the ramp right away and
+     * replaces a command posted with post() that is still waiting. Call these from loop(), not
+     * from an interrupt service routine.
      */
     void off();
 
@@ -88,6 +121,14 @@ class Dimmer {
      */
     uint8_t value();
 
+    /**
+     * Gets the value the lamp is ramping to. Unlike value(), this changes as soon as the lamp is
+     * set, switched or toggled, not at the next zero crossing.
+     *
+     * @return target lamp value, from 0 to 100.
+     */
+    uint8_t target();
+
     /**
      * Gets the current state of the lamp.
      *
@@ -102,6 +143,27 @@ class Dimmer {
      */
     void set(uint8_t value);
 
+    /**
+     * Sets the value of the lamp at the next zero crossing. Meant for bursts of commands, like the
+     * messages of a slider that is being dragged: only the newest value posted before a zero
+     * crossing starts a ramp, the values it replaces are counted as coalesced.
+     *
+     * @param value the value (intensity) of the lamp. Accepts values from 0 to 100.
+     */
+    void post(uint8_t value);
+
+    /**
+     * Turns the lamp OFF at the next zero crossing. @see post()
+     */
+    void postOff();
+
+    /**
+     * Reads the counters of the posted commands. Safe to call from loop().
+     *
+     * @return a copy of the counters.
+     */
+    DimmerCommands commands();
+
     /**
      * Sets the mimimum acceptable power level. This is useful to control loads that cannot be
      * dimmed to a very low level, like dimmable LED or CFL lamps.
@@ -110,6 +172,36 @@ class Dimmer {
      */
     void setMinimum(uint8_t value);
 
+    /**
+     * Compensates the delay of the zero cross circuit for all dimmers. DIMMER_TIMER channels time
+     * their firing from the true zero crossing instead of from the edge on DIMMER_ZERO_CROSS_PIN.
+     *
+     * @param offset time in us between the true zero crossing and the edge, negative if the edge comes first.
+     */
+    static void setZeroCrossOffset(int16_t offset);
+
+    /**
+     * Gives access to the measured mains: period, frequency, jitter and missed edges.
+     *
+     * @return the tracker shared by all dimmers.
+     */
+    static ZeroCrossTracker& mains();
+
+    /**
+     * Reads the statistics of the interrupt service routines of all dimmers. Safe to call from loop().
+     * All counters stay 0 when DIMMER_STATS is 0.
+     *
+     * @return a copy of the counters.
+     */
+    static DimmerStats stats();
+
+    /**
+     * Sets how the lamp value is translated into the firing angle of the triac.
+     *
+     * @param curve DIMMER_CURVE_LINEAR (default), DIMMER_CURVE_POWER or DIMMER_CURVE_PERCEPTUAL. @see DimmerCurve.h
+     */
+    void setCurve(uint8_t curve);
+
     /**
      * Sets the time it takes for the value to rise or fall to the desired value, in seconds.
      *
@@ -118,7 +210,7 @@ class Dimmer {
     void setRampTime(double rampTime);
 
     /**
-     * Updates the timers, must be called continuously from main loop
+     * Updates the timers, must be called continuously from main loop. Not needed in DIMMER_TIMER mode.
      */
     void update();
 
@@ -141,17 +233,32 @@ class Dimmer {
     uint8_t lampValue{0};
     uint8_t maxValue{100};
     uint8_t minValue{0};
-    uint8_t rampStartValue{0};
+    int32_t rampValue{0}; // Current value in Q16 fixed point, advanced by rampStep every zero crossing
+    int32_t rampStep{0}; // Change of rampValue per zero crossing in Q16, calculated when the ramp starts
     uint8_t rampEndValue{0};
-    uint16_t rampCounter; // Where are we within the total available crossings set by setRampTime() 
+    uint16_t rampCounter{0}; // Zero crossings left before the ramp reaches rampEndValue
     uint16_t rampCycles; // Amount of zero crossings available within the given setRampTime()
     uint8_t acFreq;
-    uint16_t halfcycletime;
+    const uint16_t* curve; // Firing delay per lamp value as a fraction of the half cycle, Q16
     uint16_t pulseCount{0}; // Total of pulses given
     uint16_t zcCounter{0}; // Zero Cross Counter. Counts repeatedly till 100. Used in DIMMER_COUNT, to calculate the percentage
+    struct Ramp {
+      int32_t from; // Start value in Q16, only used by DIMMER_COMMAND_ON and DIMMER_COMMAND_OFF
+      int32_t step; // Change of rampValue per zero crossing in Q16
+      uint8_t to;
+    };
+    volatile uint8_t pendingCommand{DIMMER_COMMAND_NONE}; // Written by post(), taken by zeroCross()
+    Ramp pendingRamp{}; // Ramp of pendingCommand, worked out by post() so zeroCross() does not divide
+    uint32_t postedCount{0};
+    volatile uint32_t appliedCount{0};
     Ticker* pwmtimer{nullptr};
-    uint8_t getValue(); // calculate the current value based on the rampTime
+    uint8_t getValue(); // current value of the ramp, rounded to a whole percentage
+    Ramp plan(uint8_t command); // precalculate the ramp of a command, from loop()
+    void apply(uint8_t command, const Ramp& ramp); // start the ramp of a command, interrupts must be off
+    void applyNow(uint8_t command); // apply a command from loop()
     void zeroCross(); // function to start wait time as set by triacTimes
     void callTriac(); // trigger Triac
     friend void callZeroCross(); // triggered when zero crossing is detected
+    friend void startHalfCycle(); // process a detected or predicted zero crossing
+    friend void callTimer(); // triggered when the one-shot timer expires
 };
@@ -0,0 +1,11 @@
+/** @file
+ * Dimming curve tables, generated at compile time.
+ */
+
+#include "DimmerCurve.h"
+
+constexpr DimmerCurveTable dimmerCurves[DIMMER_CURVES]{
+  dimmerCurveTable(DIMMER_CURVE_LINEAR),
+  dimmerCurveTable(DIMMER_CURVE_POWER),
+  dimmerCurveTable(DIMMER_CURVE_PERCEPTUAL)
+};
@@ -0,0 +1,87 @@
+/** @file
+ * Lookup tables translating a lamp value into the firing delay of the triac.
+ *
+ * The tables are generated at compile time. Every entry is the delay after the zero crossing as
+ * a fraction of the half cycle in Q16 (65535 is the full half cycle), so the same table serves
+ * 50Hz and 60Hz mains: delay = (table[value] * half cycle) >> 16.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Available dimming curves.
+ *
+ * DIMMER_CURVE_LINEAR: the phase angle is linear with the value. This is the original behaviour.
+ * DIMMER_CURVE_POWER: the RMS power delivered to a resistive load is linear with the value.
+ * DIMMER_CURVE_PERCEPTUAL: the power follows the square of the value, which looks more even to the eye.
+ */
+#define DIMMER_CURVE_LINEAR     0
+#define DIMMER_CURVE_POWER      1
+#define DIMMER_CURVE_PERCEPTUAL 2
+#define DIMMER_CURVES           3
+
+/**
+ * Number of entries in a table, one for every lamp value from 0 to 100.
+ */
+#define DIMMER_CURVE_STEPS 101
+
+struct DimmerCurveTable {
+  uint16_t delay[DIMMER_CURVE_STEPS];
+};
+
+/**
+ * The tables for all curves, indexed by DIMMER_CURVE_*. They are kept in RAM so they can be read
+ * from the interrupt service routines.
+ */
+extern const DimmerCurveTable dimmerCurves[DIMMER_CURVES];
+
+// Implementation of the compile time generator
+
+constexpr double DIMMER_PI = 3.14159265358979323846;
+
+// sin(x) for 0 <= x <= 2pi, Taylor series after folding x into -pi/2..pi/2
+constexpr double dimmerSin(double x) {
+  if (x > DIMMER_PI) x -= 2 * DIMMER_PI;
+  if (x > DIMMER_PI / 2) x = DIMMER_PI - x;
+  if (x < -DIMMER_PI / 2) x = -DIMMER_PI - x;
+  double term = x;
+  double sum = x;
+  for (int n = 1; n < 10; n++) {
+    term = -term * x * x / ((2 * n) * (2 * n + 1));
+    sum += term;
+  }
+  return sum;
+}
+
+// Fraction of the full power delivered to a resistive load when the triac is fired at the given
+// phase angle (0 to pi): 1 - a/pi + sin(2a)/(2pi)
+constexpr double dimmerPower(double angle) {
+  return 1 - angle / DIMMER_PI + dimmerSin(2 * angle) / (2 * DIMMER_PI);
+}
+
+// Delay as a fraction of the half cycle that delivers the given fraction of the full power
+constexpr double dimmerDelayForPower(double power) {
+  double low = 0;
+  double high = DIMMER_PI;
+  for (int i = 0; i < 40; i++) { // dimmerPower() falls monotonically with the angle
+    double mid = (low + high) / 2;
+    if (dimmerPower(mid) > power) low = mid;
+    else high = mid;
+  }
+  return (low + high) / 2 / DIMMER_PI;
+}
+
+constexpr DimmerCurveTable dimmerCurveTable(uint8_t curve) {
+  DimmerCurveTable table{};
+  for (int value = 0; value < DIMMER_CURVE_STEPS; value++) {
+    double level = value / 100.0;
+    double delay = 1 - level;
+    if (curve == DIMMER_CURVE_POWER) delay = dimmerDelayForPower(level);
+    else if (curve == DIMMER_CURVE_PERCEPTUAL) delay = dimmerDelayForPower(level * level);
+    double q16 = delay * 65536 + 0.5;
+    table.delay[value] = q16 > 65535 ? 65535 : (uint16_t)q16;
+  }
+  return table;
+}
@@ -0,0 +1,59 @@
+/** @file
+ * Runtime statistics of the zero cross and firing interrupt service routines.
+ */
+
+#pragma once
+
+#include "Hal.h"
+
+/**
+ * Set DIMMER_STATS to 0 to compile the statistics out of the interrupt service routines.
+ */
+#ifndef DIMMER_STATS
+#define DIMMER_STATS 1
+#endif
+
+/**
+ * Number of buckets in the latency histogram. Bucket 0 counts firings that were on time, bucket n
+ * firings that were 2^(n-1) to 2^n - 1 us late. The last bucket also holds everything later.
+ */
+#define DIMMER_STATS_BUCKETS 16
+
+/**
+ * A firing more than this many microseconds after its firing time counts as a late fire.
+ */
+#ifndef DIMMER_LATE_LIMIT
+#define DIMMER_LATE_LIMIT 64
+#endif
+
+/**
+ * Counters of the interrupt service routines.
+ *
+ * Only the interrupt service routines write the counters. Every counter is one aligned 32 bit word,
+ * so loop() can read them without disabling interrupts. @see Dimmer::stats()
+ */
+struct DimmerStats {
+  uint32_t edges;     // Edges on the zero cross pin
+  uint32_t bounces;   // Edges rejected as a bounce
+  uint32_t missed;    // Half cycles without an edge, for instance while the interrupt was detached
+  uint32_t fires;     // Triac firings timed after a zero crossing
+  uint32_t lateFires; // Firings later than DIMMER_LATE_LIMIT
+  uint32_t latency[DIMMER_STATS_BUCKETS]; // Histogram of how late the firings were
+};
+
+#if DIMMER_STATS
+#define DIMMER_STAT_INC(counter) (counter)++
+#define DIMMER_STAT_LATENCY(stats, late) dimmerStatLatency(stats, late)
+#else
+#define DIMMER_STAT_INC(counter)
+#define DIMMER_STAT_LATENCY(stats, late)
+#endif
+
+// Records one firing that was late microseconds after its firing time
+inline void ICACHE_RAM_ATTR dimmerStatLatency(DimmerStats& stats, uint32_t late) {
+  uint8_t bucket = late ? 32 - __builtin_clz(late) : 0; // Position of the highest bit set
+  if (bucket >= DIMMER_STATS_BUCKETS) bucket = DIMMER_STATS_BUCKETS - 1;
+  stats.latency[bucket]++;
+  stats.fires++;
+  if (late > DIMMER_LATE_LIMIT) stats.lateFires++;
+}
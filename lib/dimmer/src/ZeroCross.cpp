@@ -0,0 +1,112 @@
+/** @file
+ * Tracks the mains frequency and phase from the edges of the zero cross circuit.
+ */
+
+#include "Hal.h"
+#include "ZeroCross.h"
+
+// Edges further apart than this many half cycles start tracking from scratch
+#define ZEROCROSS_MAX_GAP 100
+
+// Range of the half cycle period that is accepted, 45Hz to 71Hz
+#define ZEROCROSS_MIN_PERIOD (7000UL << 4)
+#define ZEROCROSS_MAX_PERIOD (11000UL << 4)
+
+void ZeroCrossTracker::begin(uint8_t freq) {
+  periodQ4 = (500000UL << 4) / freq; // 1sec/freq/2 = 1000000usec/2/ freq
+  jitterQ4 = 0;
+  tracked = 0;
+  predicted = 0;
+}
+
+bool ICACHE_RAM_ATTR ZeroCrossTracker::edge(uint32_t time) {
+  uint32_t p = periodQ4 >> 4;
+  uint32_t elapsed = time - last;
+  if (tracked && elapsed < p / 2) return false; // Too soon after the last crossing, this is a bounce
+  predicted = 0;
+  uint32_t halfcycles = 1;
+  if (elapsed > p + p / 2) halfcycles = (elapsed + p / 2) / p; // Edges were missed, rarely happens
+  if (tracked == 0 || halfcycles > ZEROCROSS_MAX_GAP) {
+    // No usable reference, this edge becomes the reference
+    if (tracked) missedCount += halfcycles - 1; // For instance while the interrupt was detached
+    last = time;
+    lastFrac = 0;
+    tracked = 1;
+    return true;
+  }
+  missedCount += halfcycles - 1;
+  int32_t error = (int32_t)(elapsed << 4) - lastFrac - (int32_t)(halfcycles * periodQ4); // In 1/16 us
+  if (tracked < ZEROCROSS_LOCK_EDGES) {
+    // Acquiring: follow the edges closely so a 60Hz grid is picked up quickly when 50Hz was expected
+    if (halfcycles == 1) periodQ4 += error / 2;
+    if (periodQ4 < ZEROCROSS_MIN_PERIOD) periodQ4 = ZEROCROSS_MIN_PERIOD;
+    if (periodQ4 > ZEROCROSS_MAX_PERIOD) periodQ4 = ZEROCROSS_MAX_PERIOD;
+    last = time;
+    lastFrac = 0;
+    tracked++;
+    return true;
+  }
+  if (error > (int32_t)periodQ4 / 4 || error < -(int32_t)periodQ4 / 4) {
+    // Far off the prediction, lock is lost
+    last = time;
+    lastFrac = 0;
+    tracked = 1;
+    return true;
+  }
+  if (halfcycles == 1) periodQ4 += error / 16;
+  advance(halfcycles, error);
+  uint32_t size = error < 0 ? -error : error;
+  jitterQ4 += ((int32_t)size - (int32_t)jitterQ4) / 8;
+  if (tracked < 0xFF) tracked++;
+  return true;
+}
+
+bool ICACHE_RAM_ATTR ZeroCrossTracker::predict() {
+  if (tracked < ZEROCROSS_LOCK_EDGES) return false;
+  if (++predicted > ZEROCROSS_MAX_PREDICTED) {
+    tracked = 0; // The mains is gone, wait for edges to start again
+    return false;
+  }
+  missedCount++;
+  advance(1, 0);
+  return true;
+}
+
+// Moves the crossing forward by a number of half cycles plus 1/4 of the phase error
+void ICACHE_RAM_ATTR ZeroCrossTracker::advance(uint32_t halfcycles, int32_t error) {
+  uint32_t total = lastFrac + halfcycles * periodQ4 + error / 4;
+  last += total >> 4;
+  lastFrac = total & 0x0F;
+}
+
+uint32_t ICACHE_RAM_ATTR ZeroCrossTracker::crossing() {
+  return last;
+}
+
+uint32_t ICACHE_RAM_ATTR ZeroCrossTracker::next() {
+  return last + ((lastFrac + periodQ4) >> 4);
+}
+
+uint16_t ICACHE_RAM_ATTR ZeroCrossTracker::period() {
+  return periodQ4 >> 4;
+}
+
+uint16_t ZeroCrossTracker::frequency() {
+  return (500000UL * 100 * 16) / periodQ4;
+}
+
+uint8_t ZeroCrossTracker::nominal() {
+  return periodQ4 > (9167UL << 4) ? 50 : 60; // Halfway between 10000us and 8333us
+}
+
+uint16_t ZeroCrossTracker::jitter() {
+  return jitterQ4 >> 4;
+}
+
+bool ICACHE_RAM_ATTR ZeroCrossTracker::locked() {
+  return tracked >= ZEROCROSS_LOCK_EDGES;
+}
+
+uint32_t ZeroCrossTracker::missed() {
+  return missedCount;
+}
@@ -0,0 +1,105 @@
+/** @file
+ * Tracks the mains frequency and phase from the edges of the zero cross circuit.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Number of consecutive tracked edges before the tracker reports it is locked.
+ */
+#define ZEROCROSS_LOCK_EDGES 8
+
+/**
+ * Number of consecutive half cycles that may be predicted without an edge before the tracker
+ * gives up and waits for the mains to return.
+ */
+#define ZEROCROSS_MAX_PREDICTED 10
+
+/**
+ * A software phase locked loop on the zero cross edges.
+ *
+ * Every edge is compared with the predicted crossing. The difference corrects the phase by 1/4
+ * and the half cycle period by 1/16 (an alpha-beta filter), so noise on the edges is smoothed out
+ * while slow drift of the grid frequency is followed. Edges that arrive within half a period of
+ * the last crossing are bounces. The frequency (50Hz or 60Hz) is detected from the first edges.
+ */
+class ZeroCrossTracker {
+  public:
+    /**
+     * Starts tracking.
+     *
+     * @param freq expected mains frequency in Hz, used until the first edges have been measured.
+     */
+    void begin(uint8_t freq);
+
+    /**
+     * Feeds an edge of the zero cross circuit. Call from the interrupt service routine.
+     *
+     * @param time micros() at the edge.
+     * @return true if this is a new zero crossing, false if it is a bounce.
+     */
+    bool edge(uint32_t time);
+
+    /**
+     * Continues with the predicted crossing when the edge did not arrive.
+     *
+     * @return true if the prediction can be used, false if too many edges were missing and
+     * tracking stopped until edges arrive again.
+     */
+    bool predict();
+
+    /**
+     * @return micros() of the last zero crossing, after filtering. Safe to call from an interrupt.
+     */
+    uint32_t crossing();
+
+    /**
+     * @return micros() of the next zero crossing as predicted. Safe to call from an interrupt.
+     */
+    uint32_t next();
+
+    /**
+     * @return measured duration of a half cycle in us. Safe to call from an interrupt.
+     */
+    uint16_t period();
+
+    /**
+     * @return measured mains frequency in 1/100 Hz. Runs from flash, do not call from an interrupt.
+     */
+    uint16_t frequency();
+
+    /**
+     * @return the nominal mains frequency detected, 50 or 60 Hz. Runs from flash, do not call
+     * from an interrupt.
+     */
+    uint8_t nominal();
+
+    /**
+     * @return average difference between the edges and the predicted crossings, in us. Runs from
+     * flash, do not call from an interrupt.
+     */
+    uint16_t jitter();
+
+    /**
+     * @return true if the tracker follows the mains. Safe to call from an interrupt.
+     */
+    bool locked();
+
+    /**
+     * @return number of half cycles that passed without an edge. Runs from flash, do not call
+     * from an interrupt.
+     */
+    uint32_t missed();
+
+  private:
+    uint32_t last{0};        // Filtered time of the last crossing
+    uint8_t lastFrac{0};     // Fraction of last in 1/16 us
+    uint32_t periodQ4{0};    // Half cycle period in 1/16 us
+    uint32_t jitterQ4{0};    // Average absolute phase error in 1/16 us
+    uint32_t missedCount{0};
+    uint8_t tracked{0};      // Consecutive tracked edges, 0 if there is no reference edge yet
+    uint8_t predicted{0};    // Consecutive half cycles without an edge
+    void advance(uint32_t halfcycles, int32_t error);
+};
@@ -0,0 +1,122 @@
+/** @file
+ * Hardware abstraction for the dimmer libraries.
+ *
+ * On the target this simply pulls in the Arduino core. When building for the host (PlatformIO
+ * [env:native], no ARDUINO defined) the same functions are provided by a simulated board with a
+ * virtual microsecond clock, see HalSim.h.
+ *
+ * Besides the Arduino functions the HAL offers one one-shot hardware timer with microsecond
+ * resolution (timer1 on the ESP8266), used to fire the triacs independently from loop(), a way to
+ * write several output pins with a single register write, and the state of the WiFi station, so
+ * the connection manager can run against simulated outages.
+ */
+
+#pragma once
+
+#if defined(ARDUINO)
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+/**
+ * Sets the interrupt service routine of the one-shot timer.
+ */
+inline void halTimerAttach(void (*isr)()) {
+  timer1_isr_init();
+  timer1_attachInterrupt(isr);
+}
+
+/**
+ * Starts the one-shot timer. The routine set by halTimerAttach() is called once after the given time.
+ *
+ * @param us delay in microseconds, at most 1677721 (23 bit counter).
+ */
+inline void ICACHE_RAM_ATTR halTimerArm(uint32_t us) {
+  timer1_enable(TIM_DIV16, TIM_EDGE, TIM_SINGLE); // 80MHz / 16 = 5 ticks per us
+  timer1_write(us * 5);
+}
+
+/**
+ * Stops the one-shot timer without calling its routine.
+ */
+inline void ICACHE_RAM_ATTR halTimerDisarm() {
+  timer1_disable();
+}
+
+/**
+ * Writes the same level to all pins in the mask (bit n is GPIO n) at once.
+ */
+inline void ICACHE_RAM_ATTR halWritePins(uint32_t mask, uint8_t value) {
+  if (value) GPOS = mask & 0xFFFF;
+  else GPOC = mask & 0xFFFF;
+  if (mask & (1UL << 16)) digitalWrite(16, value); // GPIO16 is not part of the GPIO register
+}
+
+/**
+ * Starts joining a WiFi network. The station keeps rejoining by itself when the network is lost.
+ */
+inline void halWifiBegin(const char* ssid, const char* password) {
+  WiFi.begin(ssid, password);
+}
+
+/**
+ * @return true if the station has joined the network and has an address.
+ */
+inline bool halWifiConnected() {
+  return WiFi.status() == WL_CONNECTED;
+}
+
+/**
+ * @return IPv4 address of the station, the first byte in the lowest bits.
+ */
+inline uint32_t halWifiAddress() {
+  return WiFi.localIP();
+}
+
+/**
+ * @return signal strength in dBm.
+ */
+inline int32_t halWifiRssi() {
+  return WiFi.RSSI();
+}
+
+#else
+
+#include <stdint.h>
+#include <functional>
+
+#define ICACHE_RAM_ATTR
+
+#define LOW    0x0
+#define HIGH   0x1
+
+#define INPUT  0x00
+#define OUTPUT 0x01
+
+#define RISING  0x01
+#define FALLING 0x02
+#define CHANGE  0x03
+
+#define digitalPinToInterrupt(p) (p)
+
+uint32_t micros();
+uint32_t millis();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*isr)(), int mode);
+void detachInterrupt(uint8_t pin);
+void noInterrupts();
+void interrupts();
+
+void halTimerAttach(void (*isr)());
+void halTimerArm(uint32_t us);
+void halTimerDisarm();
+void halWritePins(uint32_t mask, uint8_t value);
+
+void halWifiBegin(const char* ssid, const char* password);
+bool halWifiConnected();
+uint32_t halWifiAddress();
+int32_t halWifiRssi();
+
+#endif
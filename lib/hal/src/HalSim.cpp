@@ -0,0 +1,244 @@
+/** @file
+ * Simulated board for the host build. Compiles to nothing on the target.
+ */
+
+#if !defined(ARDUINO)
+
+#include <chrono>
+#include <random>
+#include "HalSim.h"
+
+#define SIM_MAX_PIN 32
+
+namespace {
+  uint64_t virtualTime{0};      // Virtual time in us
+  double halfcycle{10000};      // Duration of a mains half cycle in us
+  double crossing{0};           // Time of the next true zero crossing
+  double previousCrossing{0};   // Time of the last true zero crossing
+  uint32_t edgeOffset{0};       // Optocoupler delay
+  uint32_t edgeJitter{0};       // Maximum random extra delay of the edge
+  uint64_t nextEdge{0};         // Time the next edge reaches the zero cross pin
+  uint32_t dropped{0};          // Number of coming edges that will not raise the interrupt
+  uint8_t bounces{0};           // Extra edges following every edge
+  uint32_t bounceSpacing{0};    // Time between the extra edges
+  uint8_t bouncesLeft{0};       // Extra edges still to come after the last edge
+  uint64_t nextBounce{0};       // Time of the next extra edge
+  bool mains{false};
+  std::minstd_rand rng;
+  uint8_t pins[SIM_MAX_PIN]{0};
+  uint8_t isrPin{0xFF};
+  void (*isr)(){nullptr};
+  void (*timerIsr)(){nullptr};
+  bool timerArmed{false};
+  uint64_t timerDeadline{0};    // Time the one-shot timer expires
+  sim::PinWatcher watcher{nullptr};
+  sim::IsrStats stats{0, 0, 0};
+  sim::Counters halCounters{0, 0, 0};
+  bool wifiUp{false};           // The access point is reachable
+  bool wifiBegun{false};        // halWifiBegin() was called
+  uint64_t wifiJoined{0};       // Time the station has joined, once the access point is reachable
+  uint32_t wifiJoin{0};         // Time the station needs to join
+
+  void scheduleEdge() {
+    nextEdge = (uint64_t)crossing + edgeOffset;
+    if (edgeJitter) nextEdge += rng() % (edgeJitter + 1);
+  }
+
+  // Runs an interrupt service routine and records how long it took on the host
+  void runIsr(void (*routine)()) {
+    auto start = std::chrono::steady_clock::now();
+    routine();
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    stats.calls++;
+    stats.totalNs += ns;
+    if (ns > stats.maxNs) stats.maxNs = ns;
+  }
+}
+
+uint32_t micros() {
+  return (uint32_t)virtualTime;
+}
+
+uint32_t millis() {
+  return (uint32_t)(virtualTime / 1000);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  if (pin >= SIM_MAX_PIN) return;
+  pins[pin] = value;
+  if (watcher) watcher(pin, value, (uint32_t)virtualTime);
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin >= SIM_MAX_PIN) return LOW;
+  return pins[pin];
+}
+
+void attachInterrupt(uint8_t pin, void (*routine)(), int mode) {
+  (void)mode; // The zero cross source only produces rising edges
+  isrPin = pin;
+  isr = routine;
+}
+
+void detachInterrupt(uint8_t pin) {
+  if (pin == isrPin) isr = nullptr;
+}
+
+// Interrupts are only raised inside sim::advance(), code called from loop() is never interrupted
+void noInterrupts() {
+}
+
+void interrupts() {
+}
+
+void halTimerAttach(void (*routine)()) {
+  timerIsr = routine;
+}
+
+void halTimerArm(uint32_t us) {
+  halCounters.timerArms++;
+  timerDeadline = virtualTime + us;
+  timerArmed = true;
+}
+
+void halTimerDisarm() {
+  timerArmed = false;
+}
+
+void halWritePins(uint32_t mask, uint8_t value) {
+  halCounters.pinWrites++;
+  for (uint8_t pin = 0; pin < SIM_MAX_PIN; pin++) {
+    if (mask & (1UL << pin)) digitalWrite(pin, value);
+  }
+}
+
+void halWifiBegin(const char* ssid, const char* password) {
+  (void)ssid;
+  (void)password;
+  halCounters.wifiBegins++;
+  wifiBegun = true;
+  wifiJoined = virtualTime + wifiJoin;
+}
+
+bool halWifiConnected() {
+  return wifiUp && wifiBegun && virtualTime >= wifiJoined;
+}
+
+uint32_t halWifiAddress() {
+  return halWifiConnected() ? 0x3201A8C0 : 0; // 192.168.1.50
+}
+
+int32_t halWifiRssi() {
+  return -60;
+}
+
+namespace sim {
+
+  void reset() {
+    virtualTime = 0;
+    mains = false;
+    dropped = 0;
+    bounces = 0;
+    bouncesLeft = 0;
+    timerArmed = false;
+    for (uint8_t i = 0; i < SIM_MAX_PIN; i++) pins[i] = LOW;
+    watcher = nullptr;
+    stats = {0, 0, 0};
+    halCounters = {0, 0, 0};
+    wifiUp = false;
+    wifiBegun = false;
+    rng.seed(1);
+  }
+
+  void setMains(double freq, uint32_t offset, uint32_t jitter) {
+    halfcycle = 500000.0 / freq;
+    edgeOffset = offset;
+    edgeJitter = jitter;
+    previousCrossing = virtualTime;
+    crossing = virtualTime + halfcycle;
+    mains = true;
+    scheduleEdge();
+  }
+
+  void setWifi(bool up, uint32_t join) {
+    if (up && !wifiUp) wifiJoined = virtualTime + join;
+    wifiUp = up;
+    wifiJoin = join;
+  }
+
+  void dropEdges(uint32_t count) {
+    dropped = count;
+  }
+
+  void setBounce(uint8_t count, uint32_t spacing) {
+    bounces = count;
+    bounceSpacing = spacing;
+  }
+
+  void advance(uint32_t us) {
+    uint64_t target = virtualTime + us;
+    for (;;) {
+      bool edgeDue = mains && nextEdge <= target;
+      bool timerDue = timerArmed && timerDeadline <= target;
+      bool bounceDue = bouncesLeft && nextBounce <= target;
+      if (bounceDue && (!edgeDue || nextBounce <= nextEdge) && (!timerDue || nextBounce < timerDeadline)) {
+        virtualTime = nextBounce;
+        nextBounce += bounceSpacing;
+        bouncesLeft--;
+        if (isr) runIsr(isr);
+      }
+      else if (timerDue && (!edgeDue || timerDeadline <= nextEdge)) {
+        virtualTime = timerDeadline;
+        timerArmed = false;
+        if (timerIsr) runIsr(timerIsr);
+      }
+      else if (edgeDue) {
+        virtualTime = nextEdge;
+        previousCrossing = crossing;
+        crossing += halfcycle;
+        scheduleEdge();
+        if (dropped) {
+          dropped--;
+          continue;
+        }
+        bouncesLeft = bounces;
+        nextBounce = virtualTime + bounceSpacing;
+        if (isr) runIsr(isr);
+      }
+      else break;
+    }
+    virtualTime = target;
+  }
+
+  uint32_t now() {
+    return (uint32_t)virtualTime;
+  }
+
+  uint32_t lastCrossing() {
+    return (uint32_t)previousCrossing;
+  }
+
+  double halfCycle() {
+    return halfcycle;
+  }
+
+  void onPinWrite(PinWatcher w) {
+    watcher = w;
+  }
+
+  IsrStats isrStats() {
+    return stats;
+  }
+
+  Counters counters() {
+    return halCounters;
+  }
+
+} // namespace sim
+
+#endif
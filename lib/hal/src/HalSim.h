@@ -0,0 +1,119 @@
+/** @file
+ * Controls for the simulated board used by the host build.
+ *
+ * The simulation keeps a virtual microsecond clock that only moves when advance() is called.
+ * While advancing, a mains zero cross source raises the attached interrupt at every half cycle,
+ * exactly like the optocoupler on DIMMER_ZERO_CROSS_PIN does on the real board, and the one-shot
+ * timer calls its routine when it expires. A simulated access point can come and go.
+ */
+
+#pragma once
+
+#if !defined(ARDUINO)
+
+#include "Hal.h"
+
+namespace sim {
+
+  /**
+   * Called for every digitalWrite() with the pin, the new level and the virtual time in us.
+   */
+  using PinWatcher = std::function<void(uint8_t pin, uint8_t value, uint32_t time)>;
+
+  /**
+   * Host time spent inside interrupt service routines.
+   */
+  struct IsrStats {
+    uint32_t calls;
+    uint64_t totalNs;
+    uint64_t maxNs;
+  };
+
+  /**
+   * Use of the HAL extensions.
+   */
+  struct Counters {
+    uint32_t timerArms;  // Calls to halTimerArm()
+    uint32_t pinWrites;  // Calls to halWritePins()
+    uint32_t wifiBegins; // Calls to halWifiBegin()
+  };
+
+  /**
+   * Resets the virtual clock, the mains source, the pin states and the statistics.
+   */
+  void reset();
+
+  /**
+   * Sets the simulated mains.
+   *
+   * @param freq mains frequency in Hz, e.g. 50 or 60.
+   * @param offset delay in us between the true zero crossing and the edge on the zero cross pin.
+   * @param jitter maximum random extra delay in us added to every edge.
+   */
+  void setMains(double freq, uint32_t offset = 0, uint32_t jitter = 0);
+
+  /**
+   * Lets the next edges of the zero cross source get lost, as if the interrupt was disabled.
+   *
+   * @param count number of edges to drop.
+   */
+  void dropEdges(uint32_t count);
+
+  /**
+   * Makes the zero cross circuit bounce: every edge is followed by extra edges.
+   *
+   * @param count number of extra edges, 0 for a clean signal.
+   * @param spacing time in us between the extra edges.
+   */
+  void setBounce(uint8_t count, uint32_t spacing);
+
+  /**
+   * Makes the access point reachable or not. The station joins it once halWifiBegin() has been
+   * called and the access point has been reachable for the join time. Like the ESP8266, it joins
+   * again by itself after an outage.
+   *
+   * @param up true if the access point is reachable.
+   * @param join time in us the station needs to join.
+   */
+  void setWifi(bool up, uint32_t join = 100000);
+
+  /**
+   * Moves the virtual clock forward, raising interrupts when they are due.
+   *
+   * @param us number of microseconds to advance.
+   */
+  void advance(uint32_t us);
+
+  /**
+   * @return the virtual time in us.
+   */
+  uint32_t now();
+
+  /**
+   * @return virtual time in us of the last true zero crossing of the mains.
+   */
+  uint32_t lastCrossing();
+
+  /**
+   * @return the duration of a mains half cycle in us.
+   */
+  double halfCycle();
+
+  /**
+   * Installs a watcher for pin writes. Pass nullptr to remove it.
+   */
+  void onPinWrite(PinWatcher watcher);
+
+  /**
+   * @return the time spent in interrupt service routines since the last reset.
+   */
+  IsrStats isrStats();
+
+  /**
+   * @return the use of the HAL extensions since the last reset.
+   */
+  Counters counters();
+
+} // namespace sim
+
+#endif
@@ -4,9 +4,15 @@
 #include <Arduino.h>
 #include <OneButton.h>
 #include <ESP8266WiFi.h>
+#include <LittleFS.h>
 #include "Dimmer.h"
 #include "PubSubClient.h"
+#include "Connection.h"
+#include "Spool.h"
 #include "Json.h"
+#include "DomoticzEncoder.h"
+#include "DomoticzFilter.h"
+#include "DomoticzRouter.h"
 #include "Receive.h"
 
 #ifndef DEBUGGING
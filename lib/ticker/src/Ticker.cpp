@@ -32,6 +32,7 @@ Ticker::Ticker(fptr callback, uint32_t timer, uint32_t repeat, resolution_t reso
 	this->callback = callback;
 	enabled = false;
 	lastTime = 0;
+	diffTime = 0;
 	counts = 0;
 	}
 
@@ -25,7 +25,7 @@
 #ifndef TICKER_H
 #define TICKER_H
 
-#include "Arduino.h"
+#include "Hal.h"
 
 /** Ticker internal resolution
  *
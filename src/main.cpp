@@ -8,7 +8,7 @@ const uint8_t GPIO4{4};
 const uint8_t TRIACPIN{12};
 bool status{false};
 OneButton Sw1(SW1, true);
-Dimmer dimmer(TRIACPIN, DIMMER_NORMAL);
+Dimmer dimmer(TRIACPIN, DIMMER_TIMER);
 //Dimmer dimmer(TRIACPIN, DIMMER_NORMAL);
 void Handleswitch();
 
@@ -19,6 +19,7 @@ const char *wifi_password{"ULW397E9"};
 const char *mqtt_server{"192.168.1.21"};
 const char *mqtt_topic_out{"domoticz/out"};
 const char *mqtt_topic_in{"domoticz/in"};
+const char *mqtt_topic_status{"dimmer/status"}; // Statistics of the dimmer interrupts
 const char *mqtt_username{"mqtt"};
 const char *mqtt_password{"1Edereen"};
 // The client id identifies the ESP8266 device. Think of it a bit like a hostname (Or just a name, like Erik).
@@ -32,8 +33,19 @@ const int mqtt_port{1883};
 // Initialise the WiFi and MQTT Client objects
 WiFiClient wifiClient;
 PubSubClient client(mqtt_server, mqtt_port, wifiClient);
+uint8_t mqttRxBuffer[320]; // Largest message expected on domoticz/out
+uint8_t mqttTxBuffer[128]; // CONNECT, SUBSCRIBE and PUBLISH headers, payloads are not copied
 void callback(char *, unsigned char *, unsigned int); // to call when something via MQTT has been received
-void Connect(); // Declaration to function to Initialise WiFi and MQTT
+Connection connection(client, ssid, wifi_password); // Keeps WiFi and MQTT up without blocking loop()
+DomoticzRouter devices; // Devices of this node by Domoticz idx, messages for other idx are dropped
+Spool spool; // Messages published while the connection is down, kept in flash
+template <typename Encode> void Publish(const char *, Encode);
+void ReportState();
+#if DIMMER_STATS
+const unsigned long STATS_INTERVAL{60000}; // Publish the dimmer statistics every minute
+unsigned long statsTime{0};
+void PublishStats();
+#endif
 
 void setup() {
   // put your setup code here, to run once:
@@ -44,27 +56,97 @@ void setup() {
   Sw1.attachClick([](){Handleswitch();});
   dimmer.begin(0);
   dimmer.setMinimum(0);
-  client.setBufferSize(320);
+  devices.addDimmer(idx_dimmer, dimmer);
+  client.setBuffers(mqttRxBuffer, sizeof(mqttRxBuffer), mqttTxBuffer, sizeof(mqttTxBuffer));
   client.setServer(mqtt_server, mqtt_port);
   Serial.println("MQTT server set.");
-  client.setCallback(callback);
+  client.addRoute(mqtt_topic_out, callback); // Only messages on domoticz/out reach callback()
   Serial.println("Callback function initialized");
+  connection.setMqtt(clientID, mqtt_username, mqtt_password);
+  connection.subscribe(mqtt_topic_out);
+  if (LittleFS.begin() && spool.begin("/spool.bin")) {
+    Serial.printf("%u spooled messages\n", spool.size());
+  }
 }
 
 void loop() {
   // put your main code here, to run repeatedly:
-  Connect(); // Check if all connections are OK before going on
+  connection.update(); // One step towards WiFi and MQTT when they are down
   client.loop(); // See if any command is recieved from MQTT
+  if (spool.size() && connection.connected()) {
+    // Catch up in small batches, so one pass of loop() stays short
+    spool.drain([](const char *topic, const uint8_t *payload, uint16_t length) {
+      return client.publish(topic, payload, length);
+    });
+  }
   Sw1.tick();
   dimmer.update();
+#if DIMMER_STATS
+  if (millis() - statsTime >= STATS_INTERVAL) {
+    statsTime = millis();
+    PublishStats();
+  }
+#endif
 }
 
 void Handleswitch() {
   status=!status;
   digitalWrite(Led1, status);
   dimmer.toggle();
+  ReportState();
+}
+
+// Tells Domoticz about a change made on the device itself. The lamp only reaches the new state
+// at the following zero crossings, so the target is reported instead of value().
+void ReportState() {
+  uint8_t level = dimmer.target(); // Read once, the payload is written twice and must not change
+  Publish(mqtt_topic_in, [level](auto &out) {
+    if (level) domoticzSwitchlight(out, idx_dimmer, level);
+    else domoticzSwitchlight(out, idx_dimmer, "Off");
+  });
 }
 
+// Publishes right away when connected, otherwise the message waits in the spool. Messages that
+// are already waiting go first, so Domoticz sees the changes in order. The payload is written by
+// encode(out), straight to the socket or into a buffer for the spool.
+template <typename Encode>
+void Publish(const char *topic, Encode encode) {
+  if (connection.connected() && spool.size() == 0 && domoticzPublish(client, topic, encode)) return;
+  char payload[96];
+  DomoticzBuffer buffer(payload, sizeof(payload));
+  encode(buffer);
+  if (buffer.overflow) {
+    Serial.println("Message lost, too long for the spool");
+  }
+  else if (!spool.push(topic, (const uint8_t *)payload, buffer.length)) {
+    Serial.println("Message lost, spool not available");
+  }
+}
+
+#if DIMMER_STATS
+void PublishStats()
+{
+    DimmerStats stats = Dimmer::stats();
+    ZeroCrossTracker& mains = Dimmer::mains();
+    DimmerCommands commands = dimmer.commands();
+    StaticJsonDocument<JSON_OBJECT_SIZE(10) + JSON_ARRAY_SIZE(DIMMER_STATS_BUCKETS)> doc;
+    doc["edges"] = stats.edges;
+    doc["bounces"] = stats.bounces;
+    doc["missed"] = stats.missed;
+    doc["fires"] = stats.fires;
+    doc["late"] = stats.lateFires;
+    JsonArray latency = doc.createNestedArray("latency"); // Bucket n: 2^(n-1) to 2^n - 1 us late
+    for (uint8_t i = 0; i < DIMMER_STATS_BUCKETS; i++) latency.add(stats.latency[i]);
+    doc["hz"] = mains.frequency() / 100.0;
+    doc["jitter"] = mains.jitter();
+    doc["posted"] = commands.posted; // Commands from Domoticz, most of a slider drag is coalesced
+    doc["coalesced"] = commands.coalesced;
+    char buffer[320];
+    size_t length = serializeJson(doc, buffer, sizeof(buffer));
+    client.publish(mqtt_topic_status, (const uint8_t*)buffer, length);
+}
+#endif
+
 void callback(char *topic, unsigned char *payload, unsigned int length)
 {
 #ifdef DEBUG
@@ -73,66 +155,5 @@ void callback(char *topic, unsigned char *payload, unsigned int length)
     Serial.println("] ");
     Serial.println((char*)payload);
 #endif
-    Json json;
-    if (json.readJson(payload))
-    {
-        switch (json.getidx())
-        {
-            case idx_dimmer:
-                Serial.printf("IDX : %d, nvalue: %d, value1 : ", json.getidx(), json.getnvalue());
-                Serial.println(json.getsvalue1());
-                if (json.getnvalue()) {
-                    dimmer.set(json.getsvalue1());
-                }
-                else {
-                    dimmer.off();
-                }
-            break;
-        }
-    }
-}
-
-void Connect()
-{
-    if (WiFi.status() != WL_CONNECTED)
-    {
-        dimmer.disableinterrupt();
-        Serial.print("Connecting to ");
-        Serial.println(ssid);
-        // Connect to the WiFi
-        WiFi.begin(ssid, wifi_password);
-        while (WiFi.status() != WL_CONNECTED)
-        {
-            delay(500);
-            Serial.print(".");
-        }
-        // Debugging - Output the IP Address of the ESP8266
-        Serial.println("WiFi connected");
-        Serial.print("IP address: ");
-        Serial.println(WiFi.localIP());
-        // Signaalsterkte.
-        long rssi = WiFi.RSSI();
-        Serial.print("Signaal sterkte (RSSI): ");
-        Serial.print(rssi);
-        Serial.println(" dBm");
-        dimmer.enableinterrupt();
-    }
-    if (!client.connected())
-    {
-        dimmer.disableinterrupt();
-        Serial.print("connecting to MQTT :");
-        while (!client.connect(clientID, mqtt_username, mqtt_password))
-        {
-            Serial.print(".");
-        }
-        Serial.println(" Connected to MQTT Broker!");
-        while (!client.subscribe(mqtt_topic_out))
-        {
-            client.loop();
-            delay(100);
-        }
-        Serial.print("Listening to topic : ");
-        Serial.println(mqtt_topic_out);
-        dimmer.enableinterrupt();
-    }
+    devices.dispatch(payload, length);
 }
@@ -0,0 +1,44 @@
+/** @file
+ * Messages recorded on domoticz/out, as Domoticz formats them, for the host benchmarks.
+ */
+
+#pragma once
+
+static const char* const domoticzCorpus[]{
+  "{\n\t\"Battery\" : 255,\n\t\"LastUpdate\" : \"2021-01-16 12:03:41\",\n\t\"RSSI\" : 12,\n\t\"description\" : \"\",\n"
+  "\t\"dtype\" : \"Light/Switch\",\n\t\"hwid\" : \"2\",\n\t\"id\" : \"00014581\",\n\t\"idx\" : 1385,\n\t\"name\" : \"Dimmer\",\n"
+  "\t\"nvalue\" : 2,\n\t\"stype\" : \"Switch\",\n\t\"svalue1\" : \"50\",\n\t\"switchType\" : \"Dimmer\",\n\t\"unit\" : 1\n}\n",
+
+  "{\n\t\"Battery\" : 89,\n\t\"LastUpdate\" : \"2021-01-16 12:03:42\",\n\t\"RSSI\" : 6,\n\t\"description\" : \"\",\n"
+  "\t\"dtype\" : \"Temp + Humidity\",\n\t\"hwid\" : \"5\",\n\t\"id\" : \"F901\",\n\t\"idx\" : 27,\n\t\"name\" : \"Woonkamer\",\n"
+  "\t\"nvalue\" : 0,\n\t\"stype\" : \"THGN122/123/132, THGR122/228/238/268\",\n\t\"svalue1\" : \"20.6\",\n\t\"svalue2\" : \"48\",\n"
+  "\t\"svalue3\" : \"1\",\n\t\"unit\" : 1\n}\n",
+
+  "{\n\t\"Battery\" : 255,\n\t\"LastUpdate\" : \"2021-01-16 12:03:44\",\n\t\"RSSI\" : 12,\n\t\"description\" : \"\",\n"
+  "\t\"dtype\" : \"P1 Smart Meter\",\n\t\"hwid\" : \"3\",\n\t\"id\" : \"1\",\n\t\"idx\" : 12,\n\t\"name\" : \"Power\",\n"
+  "\t\"nvalue\" : 0,\n\t\"stype\" : \"Energy\",\n\t\"svalue1\" : \"4583171\",\n\t\"svalue2\" : \"4093321\",\n\t\"svalue3\" : \"0\",\n"
+  "\t\"svalue4\" : \"0\",\n\t\"svalue5\" : \"431\",\n\t\"svalue6\" : \"0\",\n\t\"unit\" : 1\n}\n",
+
+  "{\n\t\"Battery\" : 255,\n\t\"LastUpdate\" : \"2021-01-16 12:03:45\",\n\t\"RSSI\" : 12,\n\t\"description\" : \"\",\n"
+  "\t\"dtype\" : \"General\",\n\t\"hwid\" : \"3\",\n\t\"id\" : \"00082012\",\n\t\"idx\" : 1412,\n\t\"name\" : \"Gas\",\n"
+  "\t\"nvalue\" : 0,\n\t\"stype\" : \"Counter Incremental\",\n\t\"svalue1\" : \"3612.004\",\n\t\"unit\" : 1\n}\n",
+
+  "{\n\t\"Battery\" : 255,\n\t\"LastUpdate\" : \"2021-01-16 12:03:47\",\n\t\"RSSI\" : 12,\n\t\"description\" : \"Lamp boven de tafel\",\n"
+  "\t\"dtype\" : \"Light/Switch\",\n\t\"hwid\" : \"7\",\n\t\"id\" : \"00014052\",\n\t\"idx\" : 1390,\n\t\"name\" : \"Tafel\",\n"
+  "\t\"nvalue\" : 1,\n\t\"stype\" : \"Switch\",\n\t\"svalue1\" : \"0\",\n\t\"switchType\" : \"On/Off\",\n\t\"unit\" : 1\n}\n",
+
+  "{\n\t\"Battery\" : 100,\n\t\"LastUpdate\" : \"2021-01-16 12:03:50\",\n\t\"RSSI\" : 7,\n\t\"description\" : \"\",\n"
+  "\t\"dtype\" : \"Lux\",\n\t\"hwid\" : \"5\",\n\t\"id\" : \"82016\",\n\t\"idx\" : 415,\n\t\"name\" : \"Licht buiten\",\n"
+  "\t\"nvalue\" : 0,\n\t\"stype\" : \"Lux\",\n\t\"svalue1\" : \"1204\",\n\t\"unit\" : 1\n}\n",
+
+  "{\n\t\"Battery\" : 255,\n\t\"LastUpdate\" : \"2021-01-16 12:03:52\",\n\t\"RSSI\" : 12,\n\t\"description\" : \"\",\n"
+  "\t\"dtype\" : \"Wind\",\n\t\"hwid\" : \"5\",\n\t\"id\" : \"1A01\",\n\t\"idx\" : 33,\n\t\"name\" : \"Wind\",\n"
+  "\t\"nvalue\" : 0,\n\t\"stype\" : \"WTGR800\",\n\t\"svalue1\" : \"248\",\n\t\"svalue2\" : \"WSW\",\n\t\"svalue3\" : \"36\",\n"
+  "\t\"svalue4\" : \"62\",\n\t\"svalue5\" : \"7.4\",\n\t\"svalue6\" : \"4.1\",\n\t\"unit\" : 0\n}\n",
+
+  "{\n\t\"Battery\" : 255,\n\t\"LastUpdate\" : \"2021-01-16 12:03:55\",\n\t\"RSSI\" : 12,\n\t\"description\" : \"\",\n"
+  "\t\"dtype\" : \"Security\",\n\t\"hwid\" : \"1\",\n\t\"id\" : \"148702\",\n\t\"idx\" : 3,\n\t\"name\" : \"Alarm\",\n"
+  "\t\"nvalue\" : 0,\n\t\"stype\" : \"Security Panel\",\n\t\"svalue1\" : \"0\",\n\t\"switchType\" : \"Security\",\n\t\"unit\" : 0\n}\n",
+};
+
+static const uint16_t domoticzCorpusSize{sizeof(domoticzCorpus) / sizeof(domoticzCorpus[0])};
@@ -0,0 +1,318 @@
+/** @file
+ * In-memory network client with a minimal MQTT broker behind it.
+ */
+
+#include <string.h>
+#include "MockClient.h"
+#include "HalSim.h"
+#include "PubSubClient.h"
+
+// Most bytes one read returns without a fragment limit, a TCP segment on Ethernet
+#define MOCK_SEGMENT 1460
+
+// Topic aliases the broker accepts from the client in MQTT 5
+#define MOCK_TOPIC_ALIASES 10
+
+// Reads a variable byte integer, the remaining length or the length of the properties
+static uint32_t readVarint(const uint8_t*& p) {
+  uint32_t value = 0;
+  uint8_t shift = 0;
+  uint8_t digit;
+  do {
+    digit = *p++;
+    value += (uint32_t)(digit & 127) << shift;
+    shift += 7;
+  } while (digit & 128);
+  return value;
+}
+
+static void writeVarint(std::vector<uint8_t>& packet, uint32_t value) {
+  do {
+    uint8_t digit = value & 127;
+    value >>= 7;
+    packet.push_back(value ? digit | 0x80 : digit);
+  } while (value);
+}
+
+#if MQTT_VERSION == MQTT_VERSION_5
+// Finds a two byte property, returns 0 if it is not there
+static uint16_t findProperty(const uint8_t* p, uint8_t id) {
+  uint32_t length = readVarint(p);
+  const uint8_t* end = p + length;
+  while (p < end) {
+    uint8_t property = *p++;
+    if (property == id) return (p[0] << 8) + p[1];
+    if (property == 0x21 || property == 0x22 || property == 0x23) p += 2;
+    else if (property == 0x27) p += 4;
+    else return 0; // The client sends no others
+  }
+  return 0;
+}
+#endif
+
+void MockClient::reset() {
+  in.clear();
+  out.clear();
+  latency = 0;
+  fragment = 0;
+  writeLimit = 0;
+  writeBudget = MOCK_UNLIMITED;
+  lastArrival = 0;
+  up = false;
+  reachable = true;
+  connackCode = 0;
+  watchStart = nullptr;
+  watchLength = 0;
+  aliasMax = 0;
+  aliases.clear();
+  stats = Counters{};
+}
+
+void MockClient::setLatency(uint32_t us) {
+  latency = us;
+}
+
+void MockClient::setFragment(uint16_t bytes) {
+  fragment = bytes;
+}
+
+void MockClient::setWriteLimit(uint16_t bytes) {
+  writeLimit = bytes;
+}
+
+void MockClient::setWriteBudget(uint32_t bytes) {
+  writeBudget = bytes;
+}
+
+void MockClient::drop() {
+  up = false;
+  in.clear();
+  out.clear();
+}
+
+void MockClient::watch(const uint8_t* start, size_t length) {
+  watchStart = start;
+  watchLength = length;
+}
+
+void MockClient::setReachable(bool reachable) {
+  this->reachable = reachable;
+}
+
+void MockClient::setConnackCode(uint8_t code) {
+  connackCode = code;
+}
+
+void MockClient::publish(const char* topic, const uint8_t* payload, uint32_t length, uint8_t qos) {
+  static uint16_t msgId{0};
+  uint16_t topicLength = strlen(topic);
+  std::vector<uint8_t> body;
+  body.reserve(9 + topicLength + length);
+#if MQTT_VERSION == MQTT_VERSION_5
+  // Aliases for the topics, as many as the client allows, the topic is left out once it is known
+  uint16_t alias = 0;
+  bool known = false;
+  for (size_t i = 0; i < aliases.size(); i++) {
+    if (aliases[i] == topic) {
+      alias = i + 1;
+      known = true;
+    }
+  }
+  if (!alias && aliases.size() < aliasMax) {
+    aliases.push_back(topic);
+    alias = aliases.size();
+  }
+  if (known) topicLength = 0;
+#endif
+  body.push_back(topicLength >> 8);
+  body.push_back(topicLength & 0xFF);
+  body.insert(body.end(), topic, topic + topicLength);
+  if (qos) {
+    msgId++;
+    body.push_back(msgId >> 8);
+    body.push_back(msgId & 0xFF);
+  }
+#if MQTT_VERSION == MQTT_VERSION_5
+  if (alias) body.insert(body.end(), {3, 0x23, (uint8_t)(alias >> 8), (uint8_t)alias});
+  else body.push_back(0);
+#endif
+  body.insert(body.end(), payload, payload + length);
+  std::vector<uint8_t> packet{(uint8_t)(0x30 | (qos << 1))};
+  writeVarint(packet, body.size());
+  packet.insert(packet.end(), body.begin(), body.end());
+  reply(packet);
+}
+
+void MockClient::inject(const uint8_t* data, size_t length) {
+  reply(std::vector<uint8_t>(data, data + length));
+}
+
+size_t MockClient::pending() {
+  return in.size();
+}
+
+MockClient::Counters MockClient::counters() {
+  return stats;
+}
+
+int MockClient::connect(IPAddress, uint16_t) {
+  if (!reachable) return 0;
+  in.clear();
+  out.clear();
+  aliasMax = 0;
+  aliases.clear();
+  up = true;
+  return 1;
+}
+
+int MockClient::connect(const char*, uint16_t) {
+  return connect(IPAddress(), 0);
+}
+
+size_t MockClient::write(uint8_t data) {
+  return write(&data, 1);
+}
+
+size_t MockClient::write(const uint8_t* buffer, size_t size) {
+  if (!up) return 0;
+  if (writeLimit && size > writeLimit) size = writeLimit; // The rest did not fit in the socket
+  if (writeBudget != MOCK_UNLIMITED) {
+    if (size > writeBudget) size = writeBudget;
+    writeBudget -= size;
+  }
+  if (size == 0) return 0;
+  stats.writes++;
+  stats.bytesOut += size;
+  if (watchStart && buffer < watchStart + watchLength && buffer + size > watchStart) {
+    const uint8_t* from = buffer > watchStart ? buffer : watchStart;
+    const uint8_t* to = buffer + size < watchStart + watchLength ? buffer + size : watchStart + watchLength;
+    stats.watchedOut += to - from;
+  }
+  out.insert(out.end(), buffer, buffer + size);
+  broker();
+  return size;
+}
+
+int MockClient::available() {
+  size_t limit = fragment ? fragment : MOCK_SEGMENT;
+  uint32_t now = sim::now();
+  if (in.empty() || (int32_t)(now - in.back().arrival) >= 0) return in.size() < limit ? in.size() : limit; // Everything arrived
+  size_t count = 0;
+  while (count < limit && (int32_t)(now - in[count].arrival) >= 0) count++;
+  return count;
+}
+
+int MockClient::read() {
+  uint8_t data;
+  return read(&data, 1) == 1 ? data : -1;
+}
+
+int MockClient::read(uint8_t* buffer, size_t size) {
+  size_t count = available();
+  if (size > count) size = count;
+  for (size_t i = 0; i < size; i++) {
+    buffer[i] = in.front().value;
+    in.pop_front();
+  }
+  stats.bytesIn += size;
+  return size;
+}
+
+int MockClient::peek() {
+  return available() ? in.front().value : -1;
+}
+
+void MockClient::flush() {
+}
+
+void MockClient::stop() {
+  drop();
+}
+
+uint8_t MockClient::connected() {
+  return up;
+}
+
+MockClient::operator bool() {
+  return up;
+}
+
+// Answers every whole packet the MQTT client has written
+void MockClient::broker() {
+  size_t pos = 0;
+  while (out.size() - pos >= 2) {
+    const uint8_t* p = out.data() + pos + 1;
+    const uint8_t* last = out.data() + out.size();
+    uint8_t digits = 0;
+    while (p + digits < last && (p[digits] & 128)) digits++;
+    if (p + digits >= last) break; // The remaining length is not complete
+    uint32_t length = readVarint(p);
+    if ((uint32_t)(last - p) < length) break;
+    uint8_t type = out[pos] & 0xF0;
+    const uint8_t* end = p + length;
+    if (type == 0x10) { // CONNECT
+#if MQTT_VERSION == MQTT_VERSION_5
+      // Protocol name, level, flags and keep alive come before the properties
+      aliasMax = findProperty(p + 2 + ((p[0] << 8) + p[1]) + 4, 0x22);
+      aliases.clear();
+      reply({0x20, 6, 0, connackCode, 3, 0x22, 0, MOCK_TOPIC_ALIASES});
+#else
+      reply({0x20, 2, 0, connackCode});
+#endif
+    } else if (type == 0x30) { // PUBLISH
+      stats.publishes++;
+      uint16_t topicLength = (p[0] << 8) + p[1];
+      const uint8_t* id = p + 2 + topicLength;
+#if MQTT_VERSION == MQTT_VERSION_5
+      const uint8_t* properties = id + ((out[pos] & 0x06) ? 2 : 0);
+      if (findProperty(properties, 0x23) && topicLength == 0) stats.aliased++;
+#endif
+      if (out[pos] & 0x02) {
+        reply({0x40, 2, id[0], id[1]});
+        stats.acks++;
+      }
+    } else if (type == 0x80) { // SUBSCRIBE, grant the requested QoS
+      std::vector<uint8_t> suback{0x90, 0, p[0], p[1]};
+      const uint8_t* filter = p + 2;
+#if MQTT_VERSION == MQTT_VERSION_5
+      filter += readVarint(filter);
+      suback.push_back(0); // No properties
+#endif
+      while (filter < end) {
+        filter += 2 + ((filter[0] << 8) + filter[1]);
+        suback.push_back(*filter++);
+      }
+      suback[1] = suback.size() - 2;
+      reply(suback);
+    } else if (type == 0xA0) { // UNSUBSCRIBE
+#if MQTT_VERSION == MQTT_VERSION_5
+      std::vector<uint8_t> unsuback{0xB0, 0, p[0], p[1], 0};
+      const uint8_t* filter = p + 2;
+      filter += readVarint(filter);
+      while (filter < end) {
+        filter += 2 + ((filter[0] << 8) + filter[1]);
+        unsuback.push_back(0); // Success
+      }
+      unsuback[1] = unsuback.size() - 2;
+      reply(unsuback);
+#else
+      reply({0xB0, 2, p[0], p[1]});
+#endif
+    } else if (type == 0xC0) { // PINGREQ
+      reply({0xD0, 0});
+    } else if (type == 0xE0) { // DISCONNECT
+      drop();
+      return;
+    }
+    pos = end - out.data();
+  }
+  out.erase(out.begin(), out.begin() + pos);
+}
+
+// Queues a packet from the broker, it arrives after the latency and after everything sent before
+void MockClient::reply(std::vector<uint8_t> packet) {
+  uint32_t arrival = sim::now() + latency;
+  if ((int32_t)(arrival - lastArrival) < 0) arrival = lastArrival;
+  lastArrival = arrival;
+  for (uint8_t value : packet) in.push_back({arrival, value});
+}
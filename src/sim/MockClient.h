@@ -0,0 +1,135 @@
+/** @file
+ * In-memory network client with a minimal MQTT broker behind it, for measuring PubSubClient on
+ * the host.
+ *
+ * Packets written by the MQTT client are answered like a broker would: CONNACK, SUBACK, UNSUBACK,
+ * PUBACK for QoS 1 and PINGRESP. The broker speaks the MQTT_VERSION of PubSubClient; in MQTT 5
+ * it accepts topic aliases from the client and uses them for what it publishes itself. Everything the broker sends arrives after the set latency on the
+ * virtual clock and can be cut into small reads. Writes can be cut short and the connection can
+ * be broken at any time.
+ */
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "Client.h"
+
+#define MOCK_UNLIMITED 0xFFFFFFFF
+
+class MockClient : public Client {
+  public:
+    /**
+     * Traffic since the last reset().
+     */
+    struct Counters {
+      uint32_t writes;    // Calls to write()
+      uint32_t bytesOut;  // Bytes accepted by write()
+      uint32_t bytesIn;   // Bytes read by the MQTT client
+      uint32_t publishes; // PUBLISH packets received by the broker
+      uint32_t acks;      // PUBACK packets sent by the broker
+      uint32_t watchedOut; // Bytes accepted by write() straight from the memory set with watch()
+      uint32_t aliased;   // PUBLISH packets received with a topic alias instead of the topic, MQTT 5
+    };
+
+    /**
+     * Clears the pending data, the settings and the counters. The connection is closed.
+     */
+    void reset();
+
+    /**
+     * @param us delay on the virtual clock before a packet of the broker can be read.
+     */
+    void setLatency(uint32_t us);
+
+    /**
+     * @param bytes most bytes available() reports and one read() returns, 0 for a TCP segment.
+     */
+    void setFragment(uint16_t bytes);
+
+    /**
+     * @param bytes most bytes one write() accepts, 0 for no limit.
+     */
+    void setWriteLimit(uint16_t bytes);
+
+    /**
+     * @param bytes bytes write() accepts from now on, as if the socket buffer fills up and is not
+     * emptied. Once they are used up write() returns 0. MOCK_UNLIMITED for no limit.
+     */
+    void setWriteBudget(uint32_t bytes);
+
+    /**
+     * Breaks the connection. Data that has not been read is lost.
+     */
+    void drop();
+
+    /**
+     * Counts the bytes written straight from this memory, for instance the payload of a publish.
+     * Bytes of it that were copied into a buffer of the MQTT client first are not counted.
+     */
+    void watch(const uint8_t* start, size_t length);
+
+    /**
+     * @param reachable false to make connect() fail, as if the broker is down.
+     */
+    void setReachable(bool reachable);
+
+    /**
+     * @param code return code of the CONNACK, 0 to accept the connection. In MQTT 5 a reason code.
+     */
+    void setConnackCode(uint8_t code);
+
+    /**
+     * Sends a PUBLISH from the broker.
+     */
+    void publish(const char* topic, const uint8_t* payload, uint32_t length, uint8_t qos = 0);
+
+    /**
+     * Sends raw bytes from the broker, for instance part of a packet.
+     */
+    void inject(const uint8_t* data, size_t length);
+
+    /**
+     * @return bytes from the broker that have not been read yet, arrived or not.
+     */
+    size_t pending();
+
+    Counters counters();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+    size_t write(uint8_t data) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buffer, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override;
+
+  private:
+    struct Byte {
+      uint32_t arrival; // Virtual time in us when it can be read
+      uint8_t value;
+    };
+    std::deque<Byte> in;
+    std::vector<uint8_t> out; // Written bytes that do not form a whole packet yet
+    uint32_t latency{0};
+    uint16_t fragment{0};
+    uint16_t writeLimit{0};
+    uint32_t writeBudget{MOCK_UNLIMITED};
+    uint32_t lastArrival{0};
+    bool up{false};
+    bool reachable{true};
+    uint8_t connackCode{0};
+    const uint8_t* watchStart{nullptr};
+    size_t watchLength{0};
+    uint16_t aliasMax{0};              // Topic alias maximum of the client, from its CONNECT
+    std::vector<std::string> aliases; // Topics the broker sent with an alias, alias 1 first
+    Counters stats{};
+    void broker();
+    void reply(std::vector<uint8_t> packet);
+};
@@ -0,0 +1,12 @@
+/** @file
+ * The part of the Arduino core used by the MQTT client, for the host build.
+ */
+
+#include "Arduino.h"
+#include "HalSim.h"
+
+HardwareSerial Serial;
+
+void yield() {
+  sim::advance(100); // The time the core would give to the WiFi stack
+}
@@ -0,0 +1,44 @@
+/** @file
+ * The part of the Arduino core used by the MQTT client, for the host build ([env:native]).
+ *
+ * Time comes from the simulated board, see Hal.h. Only this directory is on the include path of
+ * the host build, the target uses the real core.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "Hal.h"
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define PROGMEM
+#define strlen_P strlen
+#define memcpy_P memcpy
+
+/**
+ * Lets the core do its work during a busy wait. Advances the virtual clock.
+ */
+void yield();
+
+#include "Stream.h"
+
+/**
+ * Serial port. Output is counted and dropped, so the simulation reports stay readable.
+ */
+class HardwareSerial : public Stream {
+  public:
+    size_t write(uint8_t) override {
+      written++;
+      return 1;
+    }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    uint32_t written{0}; // Bytes printed
+};
+
+extern HardwareSerial Serial;
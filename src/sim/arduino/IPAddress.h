@@ -0,0 +1,17 @@
+/** @file
+ * IPv4 address of the Arduino core, for the host build.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+class IPAddress {
+  public:
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{a, b, c, d} {}
+    uint8_t operator[](int index) const { return bytes[index]; }
+
+  private:
+    uint8_t bytes[4]{0, 0, 0, 0};
+};
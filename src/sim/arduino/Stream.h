@@ -0,0 +1,67 @@
+/** @file
+ * Print and Stream of the Arduino core, for the host build.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+class Print {
+  public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t data) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size) {
+      size_t n = 0;
+      while (size-- && write(*buffer++)) n++;
+      return n;
+    }
+
+    size_t print(const char* text) {
+      return write((const uint8_t*)text, strlen(text));
+    }
+
+    size_t print(char c) {
+      return write((uint8_t)c);
+    }
+
+    size_t print(long n) {
+      char text[12];
+      snprintf(text, sizeof(text), "%ld", n);
+      return print(text);
+    }
+
+    size_t print(unsigned long n) {
+      char text[12];
+      snprintf(text, sizeof(text), "%lu", n);
+      return print(text);
+    }
+
+    size_t print(int n) {
+      return print((long)n);
+    }
+
+    size_t print(unsigned int n) {
+      return print((unsigned long)n);
+    }
+
+    size_t println() {
+      return print("\r\n");
+    }
+
+    template <typename T>
+    size_t println(T value) {
+      size_t n = print(value);
+      return n + println();
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual void flush() {}
+};
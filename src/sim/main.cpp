@@ -0,0 +1,1044 @@
+/*
+ * Host simulation of the dimmer ([env:native]).
+ *
+ * Drives the Dimmer library from a simulated mains zero cross source on a virtual clock and
+ * reports firing-angle error, time spent in the interrupt service routines and ramp behaviour.
+ * Also measures the offline message spool on a host file and the MQTT client against the
+ * in-memory broker of MockClient, the connection manager through WiFi and broker outages, and
+ * decoding and encoding Domoticz messages.
+ * The protocol scenarios check their results with check(): the simulation exits with status 1 if
+ * any result differs from the expected one.
+ * Run with: pio run -e native -t exec, and pio run -e native_mqtt5 -t exec for MQTT 5
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <ArduinoJson.h>
+#include "Connection.h"
+#include "Dimmer.h"
+#include "DomoticzCorpus.h"
+#include "DomoticzDecoder.h"
+#include "DomoticzEncoder.h"
+#include "DomoticzFilter.h"
+#include "DomoticzRouter.h"
+#include "HalSim.h"
+#include "MockClient.h"
+#include "PubSubClient.h"
+#include "Spool.h"
+
+const uint8_t TRIACPIN{12};
+const uint8_t TIMERPIN{14};
+Dimmer dimmer(TRIACPIN, DIMMER_NORMAL); // Fired from a Ticker polled in loop()
+Dimmer timed(TIMERPIN, DIMMER_TIMER);   // Fired from the one-shot hardware timer
+Dimmer channels[]{{13, DIMMER_TIMER}, {15, DIMMER_TIMER}, {5, DIMMER_TIMER}, {2, DIMMER_TIMER}}; // Share the timer with timed
+const uint8_t channelPins[]{13, 15, 5, 2};
+
+// Every allocation on the heap is counted, to show which code paths allocate
+static uint32_t allocations{0};
+
+static uint32_t checks{0};
+static uint32_t checksFailed{0};
+
+// Compares a result of a scenario with the value it must have, a mismatch is printed and fails
+// the simulation
+static void check(const char* what, int64_t actual, int64_t expected) {
+  checks++;
+  if (actual == expected) return;
+  checksFailed++;
+  printf("CHECK FAILED: %s: %lld, expected %lld\n", what, (long long)actual, (long long)expected);
+}
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size ? size : 1);
+  if (!p) throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+struct FiringError {
+  uint32_t fires{0};
+  double sum{0};
+  double max{0};
+};
+
+// Ideal delay between the true zero crossing and firing the triac for a lamp value
+static double idealDelay(uint8_t value) {
+  return sim::halfCycle() * (100 - value) / 100.0;
+}
+
+// Runs loop() for the given time, every pass costing loopCost us of CPU time
+static void runLoop(uint32_t duration, uint32_t loopCost) {
+  uint32_t start = sim::now();
+  while (sim::now() - start < duration) {
+    dimmer.update();
+    sim::advance(loopCost);
+  }
+}
+
+static FiringError measureFiring(Dimmer& channel, uint8_t pin, double freq, uint8_t value, uint32_t loopCost,
+                                 uint32_t offset = 0, uint32_t jitter = 0) {
+  FiringError error;
+  sim::reset();
+  sim::setMains(freq, offset, jitter);
+  channel.set(value);
+  runLoop(100000, loopCost); // Let the value settle
+  sim::onPinWrite([&error, &channel, pin](uint8_t p, uint8_t level, uint32_t time) {
+    if (p != pin || level != TRIAC_NORMAL_STATE) return;
+    double e = std::fabs((double)(time - sim::lastCrossing()) - idealDelay(channel.value()));
+    error.fires++;
+    error.sum += e;
+    if (e > error.max) error.max = e;
+  });
+  runLoop(2000000, loopCost);
+  sim::onPinWrite(nullptr);
+  return error;
+}
+
+static void reportFiring() {
+  const uint32_t loopCosts[]{37, 730, 2900};
+  const uint8_t values[]{25, 50, 75};
+  printf("Firing-angle error vs loop() load (50 Hz)\n");
+  printf("%-14s %10s %6s %8s %12s %12s\n", "mode", "loop [us]", "value", "fires", "mean [us]", "max [us]");
+  for (uint32_t loopCost : loopCosts) {
+    for (uint8_t value : values) {
+      FiringError e = measureFiring(dimmer, TRIACPIN, 50, value, loopCost);
+      printf("%-14s %10u %6u %8u %12.1f %12.1f\n", "DIMMER_NORMAL", loopCost, value, e.fires, e.fires ? e.sum / e.fires : 0, e.max);
+      e = measureFiring(timed, TIMERPIN, 50, value, loopCost);
+      printf("%-14s %10u %6u %8u %12.1f %12.1f\n", "DIMMER_TIMER", loopCost, value, e.fires, e.fires ? e.sum / e.fires : 0, e.max);
+    }
+  }
+}
+
+// Four channels on one zero cross detector and one timer, two of them at the same value
+static void reportChannels() {
+  const uint8_t values[]{20, 40, 40, 80};
+  const uint32_t halfcycles{100};
+  FiringError errors[4];
+  sim::reset();
+  sim::setMains(50);
+  dimmer.set(0);
+  timed.set(0);
+  for (uint8_t i = 0; i < 4; i++) channels[i].set(values[i]);
+  runLoop(100000, 37);
+  sim::Counters before = sim::counters();
+  sim::onPinWrite([&errors](uint8_t pin, uint8_t level, uint32_t time) {
+    if (level != TRIAC_NORMAL_STATE) return;
+    for (uint8_t i = 0; i < 4; i++) {
+      if (pin != channelPins[i]) continue;
+      double e = std::fabs((double)(time - sim::lastCrossing()) - idealDelay(channels[i].value()));
+      errors[i].fires++;
+      errors[i].sum += e;
+      if (e > errors[i].max) errors[i].max = e;
+    }
+  });
+  runLoop(halfcycles * 10000, 2900);
+  sim::onPinWrite(nullptr);
+  sim::Counters after = sim::counters();
+  printf("\nShared firing schedule, 4 channels at 20/40/40/80 with a 2.9 ms loop()\n");
+  for (uint8_t i = 0; i < 4; i++) {
+    printf("channel %u value %3u: %u fires, max error %.1f us\n", i, values[i], errors[i].fires, errors[i].max);
+  }
+  printf("per half cycle: %.2f timer arms, %.2f port writes\n",
+         (double)(after.timerArms - before.timerArms) / halfcycles, (double)(after.pinWrites - before.pinWrites) / halfcycles);
+  // One write resets the gates of all 6 dimmers, the two channels at 40 fire together
+  check("port writes per half cycle", after.pinWrites - before.pinWrites, 4 * halfcycles);
+  for (uint8_t i = 0; i < 4; i++) channels[i].set(0);
+  runLoop(100000, 37);
+}
+
+// Mains tracking: frequency detection, noisy edges and missed edges
+static void reportTracking() {
+  printf("\nZero cross tracking (DIMMER_TIMER, value 50)\n");
+  FiringError e = measureFiring(timed, TIMERPIN, 60, 50, 37);
+  ZeroCrossTracker& mains = Dimmer::mains();
+  printf("60 Hz mains, 50 Hz configured: detected %u Hz (%u.%02u Hz), period %u us, max error %.1f us\n",
+         mains.nominal(), mains.frequency() / 100, mains.frequency() % 100, mains.period(), e.max);
+  e = measureFiring(timed, TIMERPIN, 49.9, 50, 37, 300, 200);
+  printf("49.9 Hz, edges 300-500 us late, no compensation: mean error %.1f us, max %.1f us, edge jitter %u us\n",
+         e.sum / e.fires, e.max, mains.jitter());
+  Dimmer::setZeroCrossOffset(400);
+  e = measureFiring(timed, TIMERPIN, 49.9, 50, 37, 300, 200);
+  printf("49.9 Hz, edges 300-500 us late, offset 400 us: mean error %.1f us, max %.1f us\n", e.sum / e.fires, e.max);
+  Dimmer::setZeroCrossOffset(0);
+  uint32_t fires{0};
+  uint32_t missed = mains.missed();
+  sim::onPinWrite([&fires](uint8_t pin, uint8_t level, uint32_t) {
+    if (pin == TIMERPIN && level == TRIAC_NORMAL_STATE) fires++;
+  });
+  sim::dropEdges(5);
+  runLoop(1000000, 37);
+  sim::onPinWrite(nullptr);
+  printf("5 edges dropped in 100 half cycles: %u fires, %u crossings predicted\n", fires, mains.missed() - missed);
+  timed.set(0);
+  runLoop(100000, 37);
+}
+
+// ISR statistics with a bouncing zero cross circuit, polled and timed firing
+static void reportStats() {
+  struct {
+    const char* name;
+    Dimmer& channel;
+    uint32_t loopCost;
+  } runs[]{{"DIMMER_NORMAL", dimmer, 730}, {"DIMMER_TIMER", timed, 730}};
+  printf("\nISR statistics, 3 bounces per edge, 1 s at value 50\n");
+  for (auto& run : runs) {
+    sim::reset();
+    sim::setMains(50);
+    sim::setBounce(3, 50);
+    run.channel.set(50);
+    runLoop(100000, run.loopCost);
+    DimmerStats before = Dimmer::stats();
+    runLoop(1000000, run.loopCost);
+    DimmerStats after = Dimmer::stats();
+    printf("%-14s edges %u, bounces %u, fires %u, late %u, latency:", run.name, after.edges - before.edges,
+           after.bounces - before.bounces, after.fires - before.fires, after.lateFires - before.lateFires);
+    for (uint8_t i = 0; i < DIMMER_STATS_BUCKETS; i++) {
+      uint32_t count = after.latency[i] - before.latency[i];
+      if (count) printf(" <%uus:%u", 1U << i, count);
+    }
+    printf("\n");
+    run.channel.set(0);
+    runLoop(100000, run.loopCost);
+  }
+  sim::setBounce(0, 0);
+}
+
+void callZeroCross();
+
+// Host time per callZeroCross() while both channels are ramping, so the ramp stepper is exercised
+static void reportIsrCost() {
+  const uint32_t crossings{1000000};
+  sim::reset(); // No mains, the zero cross routine is called directly
+  dimmer.setRampTime(crossings / 100);
+  timed.setRampTime(crossings / 100);
+  dimmer.set(100);
+  timed.set(100);
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < crossings; i++) sim::advance(10000);
+  auto idle = std::chrono::steady_clock::now() - start;
+  start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < crossings; i++) {
+    sim::advance(10000);
+    callZeroCross();
+  }
+  auto busy = std::chrono::steady_clock::now() - start;
+  double ns = std::chrono::duration<double, std::nano>(busy - idle).count() / crossings;
+  printf("\ncallZeroCross() on host while ramping 2 channels: %.1f ns per zero crossing\n", ns);
+  dimmer.setRampTime(0);
+  timed.setRampTime(0);
+  dimmer.set(0);
+  timed.set(0);
+}
+
+// Checks the curve tables against the analytic power integral of a phase cut sine wave
+static void reportCurves() {
+  const char* names[DIMMER_CURVES]{"linear", "power", "perceptual"};
+  printf("\nCurve tables vs power integral\n");
+  printf("%-12s %14s %16s %16s\n", "curve", "max error [%]", "50% @50Hz [us]", "50% @60Hz [us]");
+  for (uint8_t c = 0; c < DIMMER_CURVES; c++) {
+    double maxError = 0;
+    for (uint8_t value = 0; value <= 100; value++) {
+      double delay = dimmerCurves[c].delay[value] / 65536.0;
+      double level = value / 100.0;
+      double actual = 1 - delay + std::sin(2 * M_PI * delay) / (2 * M_PI); // Delivered power
+      double expected = c == DIMMER_CURVE_POWER ? level : level * level;
+      if (c == DIMMER_CURVE_LINEAR) { // Linear in phase angle, not in power
+        actual = delay;
+        expected = 1 - level;
+      }
+      double error = std::fabs(actual - expected) * 100;
+      if (error > maxError) maxError = error;
+    }
+    printf("%-12s %14.4f %16u %16u\n", names[c], maxError,
+           (unsigned)((dimmerCurves[c].delay[50] * 10000UL) >> 16), (unsigned)((dimmerCurves[c].delay[50] * 8333UL) >> 16));
+  }
+}
+
+static void reportRamp() {
+  sim::reset();
+  sim::setMains(50);
+  dimmer.set(0);
+  runLoop(100000, 20);
+  dimmer.setRampTime(1.0);
+  dimmer.set(100);
+  printf("\nRamp 0 -> 100 with rampTime 1.0 s\n");
+  for (uint8_t step = 0; step <= 12; step++) {
+    printf("%6u ms %4u\n", step * 100, dimmer.value());
+    runLoop(100000, 20);
+  }
+  dimmer.setRampTime(0);
+}
+
+// A slider dragged from 10 to 90 in Domoticz: a message every 4 ms for 400 ms, handed to the
+// dimmer with set() as each arrives or with post(), which only keeps the newest per half cycle
+static void reportCommands() {
+  const uint32_t interval{4000};
+  const uint8_t messages{100};
+  printf("\nSlider burst, %u messages %u ms apart, rampTime 0.5 s\n", messages, interval / 1000);
+  printf("%-6s %10s %10s %10s %14s %14s\n", "", "ramps", "coalesced", "ns/call", "value at end", "settled [ms]");
+  uint8_t setAtEnd{0};
+  for (bool posted : {false, true}) {
+    sim::reset();
+    sim::setMains(50);
+    dimmer.setRampTime(0); // Both passes start from 10, not from where the ramp of the last one was
+    dimmer.set(10);
+    runLoop(100000, 20);
+    dimmer.setRampTime(0.5);
+    DimmerCommands before = dimmer.commands();
+    double ns{0};
+    for (uint8_t i = 1; i <= messages; i++) {
+      uint8_t value = 10 + 80 * i / messages;
+      auto start = std::chrono::steady_clock::now();
+      if (posted) dimmer.post(value);
+      else dimmer.set(value);
+      ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+      runLoop(interval, 20);
+    }
+    uint8_t atEnd = dimmer.value();
+    uint32_t end = sim::now();
+    while (dimmer.value() != 90 && sim::now() - end < 2000000) runLoop(1000, 20);
+    DimmerCommands after = dimmer.commands();
+    uint32_t ramps = posted ? after.applied - before.applied : messages;
+    printf("%-6s %10u %10u %10.0f %14u %14u\n", posted ? "post" : "set", ramps, after.coalesced - before.coalesced,
+           ns / messages, atEnd, (sim::now() - end) / 1000);
+    // Retargeting keeps the fraction of the ramp, so applying only the newest command per half
+    // cycle ends where applying every one does
+    if (posted) check("value at the end of the slider burst, post() against set()", atEnd, setAtEnd);
+    setAtEnd = atEnd;
+  }
+  // Domoticz repeating the same level: every message restarts the ramp one step from where it is
+  sim::reset();
+  sim::setMains(50);
+  dimmer.setRampTime(0);
+  dimmer.set(10);
+  runLoop(100000, 20);
+  dimmer.setRampTime(0.5);
+  for (uint8_t i = 0; i < 150; i++) {
+    dimmer.set(11);
+    runLoop(4000, 20);
+  }
+  printf("set(11) every 4 ms from 10: value %u after 600 ms\n", dimmer.value());
+  check("value after repeating set(11)", dimmer.value(), 11);
+  dimmer.setRampTime(0);
+
+  // A button press between a message and the next zero crossing: the press is newer and wins
+  sim::reset();
+  sim::setMains(50);
+  dimmer.set(50);
+  runLoop(100000, 20);
+  dimmer.post(80);
+  dimmer.toggle();
+  runLoop(100000, 20);
+  printf("post(80) then toggle() before the zero crossing: value %u 100 ms later, target %u\n", dimmer.value(),
+         dimmer.target());
+}
+
+// Offline message queue on a host file: drain throughput, bytes handed to the file per byte queued
+// and recovery. LittleFS on the target programs more flash than that, see SpoolStats
+static void reportSpool() {
+  const char* path{"spool.bin"};
+  const uint32_t outages{100};
+  char payload[64];
+  uint32_t sent{0};
+  std::remove(path);
+  Spool spool;
+  spool.begin(path);
+  auto send = [&sent](const char*, const uint8_t*, uint16_t) {
+    sent++;
+    return true;
+  };
+  std::chrono::steady_clock::duration drainTime{0};
+  for (uint32_t outage = 0; outage < outages; outage++) {
+    for (uint32_t i = 0; i < SPOOL_SLOTS; i++) { // Toggles while the connection is down
+      int n = snprintf(payload, sizeof(payload), "{\"command\":\"switchlight\",\"idx\":1385,\"switchcmd\":\"%s\"}", i % 2 ? "On" : "Off");
+      spool.push("domoticz/in", (const uint8_t*)payload, n);
+    }
+    auto start = std::chrono::steady_clock::now();
+    while (spool.drain(send)) {
+    }
+    drainTime += std::chrono::steady_clock::now() - start;
+  }
+  SpoolStats stats = spool.stats();
+  double us = std::chrono::duration<double, std::micro>(drainTime).count();
+  printf("\nOffline queue, %u outages of %u messages, batches of %u\n", outages, SPOOL_SLOTS, SPOOL_BATCH);
+  printf("drained %u messages, %.0f messages/s, %.2f bytes written to the file per message byte, %.2f writes and %.3f "
+         "flushes per message\n",
+         sent, sent / us * 1e6, (double)stats.fileBytes / stats.messageBytes, (double)stats.fileWrites / stats.pushed,
+         (double)stats.fileSyncs / stats.pushed);
+  check("messages drained", sent, outages * SPOOL_SLOTS);
+  // One flush every SPOOL_SYNC pushes and one per drained batch
+  check("file flushes", stats.fileSyncs, outages * (SPOOL_SLOTS / SPOOL_SYNC + SPOOL_SLOTS / SPOOL_BATCH));
+  for (uint32_t i = 0; i < SPOOL_SLOTS + 10; i++) spool.push("domoticz/in", (const uint8_t*)"{}", 2);
+  spool.drain(send, 3);
+  Spool restarted;
+  restarted.begin(path);
+  printf("after a restart: %u of %u messages waiting, %u dropped while full\n", restarted.size(), spool.size(),
+         spool.stats().dropped);
+  check("messages waiting after a restart", restarted.size(), spool.size());
+  std::remove(path);
+  Spool missing;
+  bool opened = missing.begin("no/such/directory/spool.bin");
+  bool pushed = missing.push("domoticz/in", (const uint8_t*)"{}", 2);
+  printf("file cannot be opened: begin() %s, push() %s, drain() sent %u\n", opened ? "true" : "false",
+         pushed ? "true" : "false", missing.drain(send));
+}
+
+static MockClient network;
+static uint32_t received{0};
+static bool subscribed{false};
+static uint8_t subackCodes[4];
+static uint8_t subackCount{0};
+
+// Runs the MQTT client until done() or until the virtual time limit, every pass of loop() costing
+// 100 us. Returns the longest time in ns one call to loop() took on the host.
+static double pumpMqtt(PubSubClient& mqtt, std::function<bool()> done, uint32_t limit = 10000000) {
+  double worst{0};
+  uint32_t start = sim::now();
+  while (!done() && sim::now() - start < limit) {
+    auto before = std::chrono::steady_clock::now();
+    mqtt.loop();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - before).count();
+    if (ns > worst) worst = ns;
+    sim::advance(100);
+  }
+  return worst;
+}
+
+static void connectMqtt(PubSubClient& mqtt) {
+  mqtt.connectAsync("dimmer");
+  pumpMqtt(mqtt, [&mqtt]() { return mqtt.connected(); });
+}
+
+// PubSubClient against an in-memory broker: throughput, longest loop() and memory
+static void reportMqtt() {
+  uint8_t payload[1024];
+  for (uint32_t i = 0; i < sizeof(payload); i++) payload[i] = 'a' + i % 26;
+  printf("\nMQTT client against an in-memory broker\n");
+
+  sim::reset();
+  network.reset();
+  network.setLatency(5000);
+  PubSubClient mqtt(IPAddress(192, 168, 1, 21), 1883, network);
+  mqtt.setCallback([](char*, uint8_t*, unsigned int) { received++; });
+  mqtt.onSuback([](uint16_t, uint8_t* codes, uint8_t count) {
+    subackCount = count < sizeof(subackCodes) ? count : sizeof(subackCodes);
+    memcpy(subackCodes, codes, subackCount);
+    subscribed = true;
+  });
+  uint32_t start = sim::now();
+  mqtt.connectAsync("dimmer");
+  double worst = pumpMqtt(mqtt, [&mqtt]() { return mqtt.connected(); });
+  check("state after the CONNACK", mqtt.state(), MQTT_CONNECTED);
+  const char* filters[]{"domoticz/out", "dimmer/+/set"};
+  const uint8_t qos[]{0, 1};
+  mqtt.subscribe(filters, qos, 2);
+  worst = std::max(worst, pumpMqtt(mqtt, []() { return subscribed; }));
+  printf("connect and subscribe, 5 ms latency: %.1f ms, longest loop() %.1f us\n", (sim::now() - start) / 1000.0, worst / 1000);
+  check("SUBACK return codes", subackCount, 2);
+  check("SUBACK code of domoticz/out", subackCodes[0], 0);
+  check("SUBACK code of dimmer/+/set", subackCodes[1], 1);
+
+  // Publishing at QoS 0, with and without the staging buffer
+  const uint32_t publishes{20000};
+  uint8_t staging[512];
+  for (bool staged : {false, true}) {
+    if (staged) mqtt.setTxStaging(staging, sizeof(staging));
+    MockClient::Counters before = network.counters();
+    auto begin = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < publishes; i++) mqtt.publish("domoticz/in", payload, 64);
+    mqtt.flush();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    MockClient::Counters after = network.counters();
+    printf("publish QoS 0, 64 byte payload%s: %.0f messages/s, %.2f writes per message, %u received by the broker\n",
+           staged ? ", staged" : "", publishes / s, (double)(after.writes - before.writes) / publishes,
+           after.publishes - before.publishes);
+    check(staged ? "QoS 0 staged publishes received by the broker" : "QoS 0 publishes received by the broker",
+          after.publishes - before.publishes, publishes);
+  }
+  mqtt.setTxStaging(nullptr, 0);
+
+  // QoS 1 with 20 ms latency, limited by the in-flight window. The native build has room for 16
+  network.setLatency(20000);
+  for (uint8_t window : {1, 4, 16}) {
+    if (window > MQTT_MAX_INFLIGHT) continue;
+    mqtt.setInflightWindow(window);
+    MockClient::Counters before = network.counters();
+    start = sim::now();
+    uint32_t queued{0};
+    while (queued < 200) {
+      if (mqtt.publish("domoticz/in", payload, 64, false, 1)) queued++;
+      mqtt.loop();
+      sim::advance(100);
+    }
+    pumpMqtt(mqtt, [&mqtt]() { return mqtt.getInflight() == 0; });
+    printf("publish QoS 1, 20 ms latency, window %2u: %.0f messages/s of virtual time, %u acknowledged\n", window,
+           queued / ((sim::now() - start) / 1e6), network.counters().acks - before.acks);
+    check("QoS 1 publishes acknowledged", network.counters().acks - before.acks, queued);
+    check("QoS 1 messages still in flight", mqtt.getInflight(), 0);
+  }
+  mqtt.setInflightWindow(MQTT_MAX_INFLIGHT);
+
+  network.setLatency(0);
+
+  // A connection that breaks halfway through a packet, then a new connection
+  const uint8_t partial[]{0x30, 20, 0, 3, 'a', '/', 'b', 1, 2, 3};
+  network.inject(partial, sizeof(partial));
+  pumpMqtt(mqtt, []() { return network.pending() == 0; });
+  network.drop();
+  bool alive = mqtt.loop();
+  int state = mqtt.state();
+  connectMqtt(mqtt);
+  received = 0;
+  network.publish("domoticz/out", payload, 10);
+  pumpMqtt(mqtt, []() { return received == 1; });
+  printf("dropped halfway through a packet: loop() %s, state %d, after reconnecting %u received\n",
+         alive ? "true" : "false", state, received);
+  check("loop() after the connection dropped", alive, false);
+  check("state after the connection dropped", state, MQTT_CONNECTION_LOST);
+  check("messages received after reconnecting", received, 1);
+
+  // Writes that are cut short, the client writes the rest
+  network.setWriteLimit(16);
+  uint32_t failed{0};
+  uint32_t brokerBefore = network.counters().publishes;
+  for (uint32_t i = 0; i < 100; i++) {
+    if (!mqtt.publish("domoticz/in", payload, 64)) failed++;
+    if (!mqtt.connected()) connectMqtt(mqtt);
+  }
+  network.setWriteLimit(0);
+  printf("writes limited to 16 bytes: %u of 100 publishes failed, %u received by the broker\n", failed,
+         network.counters().publishes - brokerBefore);
+  check("publishes failed with writes limited to 16 bytes", failed, 0);
+  check("publishes received with writes limited to 16 bytes", network.counters().publishes - brokerBefore, 100);
+
+  // A socket that stops taking data in the middle of the staged packets
+  mqtt.setTxStaging(staging, sizeof(staging));
+  mqtt.publish("domoticz/in", payload, 64);
+  network.setWriteBudget(10);
+  alive = mqtt.loop();
+  printf("socket full after 10 bytes, staged: loop() %s, state %d\n", alive ? "true" : "false", mqtt.state());
+  check("loop() when the staged packets cannot be written", alive, false);
+  check("state when the staged packets cannot be written", mqtt.state(), MQTT_CONNECTION_LOST);
+  network.setWriteBudget(MOCK_UNLIMITED);
+  connectMqtt(mqtt);
+  network.setWriteBudget(100);
+  uint32_t accepted{0};
+  while (mqtt.publish("domoticz/in", payload, 64)) accepted++; // Until the staging buffer is full
+  printf("socket full after 100 bytes, staging buffer full: %u publishes staged, state %d, %s\n", accepted, mqtt.state(),
+         mqtt.connected() ? "connected" : "closed");
+  check("state when a full staging buffer cannot be written", mqtt.state(), MQTT_CONNECTION_LOST);
+  network.setWriteBudget(MOCK_UNLIMITED);
+  mqtt.setTxStaging(nullptr, 0);
+  connectMqtt(mqtt);
+
+  printf("memory: client object %u bytes with %u in-flight slots, receive buffer %u bytes, transmit buffer %u bytes\n",
+         (unsigned)sizeof(PubSubClient), MQTT_MAX_INFLIGHT, mqtt.getBufferSize(), MQTT_MAX_TX_SIZE);
+  mqtt.disconnect();
+}
+
+// Cost of dropping the messages on domoticz/out that are for other devices
+static void reportDomoticz() {
+  const uint16_t own{1385};
+  const uint32_t rounds{20000};
+  uint32_t lengths[domoticzCorpusSize];
+  for (uint16_t i = 0; i < domoticzCorpusSize; i++) lengths[i] = strlen(domoticzCorpus[i]);
+  uint32_t rejected{0};
+  uint32_t sum{0}; // Keeps the compiler from dropping the work
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < rounds; round++) {
+    for (uint16_t i = 0; i < domoticzCorpusSize; i++) {
+      uint16_t idx{0};
+      if (domoticzPeekIdx((const uint8_t*)domoticzCorpus[i], lengths[i], idx) && idx != own) rejected++;
+      sum += idx;
+    }
+  }
+  double prefilter = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  // What Json::readJson() did for every message: deserialize in place, then look up every key twice
+  char message[512];
+  start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < rounds; round++) {
+    for (uint16_t i = 0; i < domoticzCorpusSize; i++) {
+      memcpy(message, domoticzCorpus[i], lengths[i] + 1);
+      StaticJsonDocument<JSON_OBJECT_SIZE(20)> doc;
+      if (deserializeJson(doc, message)) continue;
+      if (doc.containsKey("command")) sum += strlen(doc["command"].as<const char*>());
+      if (doc.containsKey("idx")) sum += (uint16_t)doc["idx"];
+      if (doc.containsKey("nvalue")) sum += (float)doc["nvalue"];
+      if (doc.containsKey("svalue")) sum += (float)doc["svalue"];
+      if (doc.containsKey("svalue1")) sum += (float)doc["svalue1"];
+    }
+  }
+  double full = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  // Straight into the struct, in one pass
+  DomoticzMessage decoded{};
+  uint32_t failed{0};
+  start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < rounds; round++) {
+    for (uint16_t i = 0; i < domoticzCorpusSize; i++) {
+      decoded = DomoticzMessage{};
+      if (!domoticzDecode((const uint8_t*)domoticzCorpus[i], lengths[i], decoded, domoticzMessageFields)) failed++;
+      sum += decoded.idx;
+    }
+  }
+  double decoder = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  uint32_t messages = rounds * domoticzCorpusSize;
+  printf("\nidx prefilter on %u recorded domoticz/out messages (checksum %u)\n", domoticzCorpusSize, sum);
+  printf("prefilter: %.0f messages/s, %.0f ns per rejected message, %u of %u rejected\n", messages / prefilter * 1e9,
+         prefilter / messages, rejected, messages);
+  printf("JSON document: %.0f messages/s, %.0f ns per message\n", messages / full * 1e9, full / messages);
+  printf("field list decoder: %.0f messages/s, %.0f ns per message, %u failed\n", messages / decoder * 1e9,
+         decoder / messages, failed);
+  decoded = DomoticzMessage{};
+  domoticzDecode((const uint8_t*)domoticzCorpus[0], lengths[0], decoded, domoticzMessageFields);
+  printf("decoded: idx %u, nvalue %d, svalue1 %.1f\n", decoded.idx, decoded.nvalue, decoded.svalue1);
+  // Integers that do not fit their member, or need more than the 24 bits of a float
+  const struct {
+    const char* message;
+    bool valid;
+    int32_t nvalue;
+  } edges[] = {{"{\"idx\":66921,\"nvalue\":1}", false, 0},
+               {"{\"idx\":1385,\"nvalue\":1e30}", false, 0},
+               {"{\"idx\":1385,\"nvalue\":16777217}", true, 16777217},
+               {"{\"idx\":\"1385\",\"nvalue\":-2147483648}", true, INT32_MIN}};
+  for (const auto& edge : edges) {
+    decoded = DomoticzMessage{};
+    bool valid = domoticzDecode((const uint8_t*)edge.message, strlen(edge.message), decoded, domoticzMessageFields);
+    printf("%-40s %s, idx %u, nvalue %d\n", edge.message, valid ? "decoded" : "rejected", decoded.idx, decoded.nvalue);
+    check("integer field accepted", valid, edge.valid);
+    if (edge.valid) check("integer decoded exactly", decoded.nvalue, edge.nvalue);
+  }
+}
+
+// Payload bytes the MQTT client copies before they reach the socket. A QoS 0 publish writes the
+// payload from the memory of the caller, the staging buffer and the QoS 1 in-flight slots keep
+// a copy by design. The transmit buffer is 256 bytes, the 1000 byte payloads pass it by.
+static void reportCopies() {
+  const uint32_t publishes{1000};
+  static uint8_t payload[1000];
+  for (uint32_t i = 0; i < sizeof(payload); i++) payload[i] = 'a' + i % 26;
+  uint8_t staging[512];
+  printf("\nPayload bytes copied per publish, %u publishes\n", publishes);
+  printf("%-14s %8s %10s %10s %12s\n", "", "payload", "published", "copied", "writes");
+  const char* modes[]{"QoS 0", "QoS 0, staged", "QoS 1"};
+  for (uint8_t mode = 0; mode < 3; mode++) {
+    for (uint16_t size : {16, 100, 1000}) {
+      sim::reset();
+      network.reset();
+      PubSubClient mqtt(IPAddress(192, 168, 1, 21), 1883, network);
+      connectMqtt(mqtt);
+      if (mode == 1) mqtt.setTxStaging(staging, sizeof(staging));
+      network.watch(payload, size);
+      MockClient::Counters before = network.counters();
+      uint32_t published{0};
+      for (uint32_t i = 0; i < publishes; i++) {
+        if (mqtt.publish("domoticz/in", payload, size, false, mode == 2 ? 1 : 0)) published++;
+        pumpMqtt(mqtt, [&mqtt]() { return mqtt.getInflight() == 0; });
+      }
+      mqtt.flush();
+      MockClient::Counters after = network.counters();
+      uint32_t direct = after.watchedOut - before.watchedOut;
+      // QoS 1 refuses a message whose topic and payload do not fit an in-flight slot
+      bool fits = mode != 2 || strlen("domoticz/in") + size <= MQTT_INFLIGHT_SIZE;
+      check("publishes accepted", published, fits ? publishes : 0);
+      if (mode == 0) check("payload bytes copied at QoS 0", (int64_t)published * size - direct, 0);
+      printf("%-14s %8u %10u %10.0f %12.2f\n", modes[mode], size, published,
+             published ? (double)published * size / publishes - (double)direct / publishes : 0,
+             (double)(after.writes - before.writes) / publishes);
+      mqtt.disconnect();
+    }
+  }
+}
+
+// The incremental packet reader on fragmented streams: every read returns at most the given
+// number of bytes, and a packet can stop halfway for a while. loop() must only take what has
+// arrived, so no pass may spend virtual time waiting inside loop().
+static void reportReader() {
+  const uint32_t messages{2000};
+  uint8_t payload[200];
+  for (uint32_t i = 0; i < sizeof(payload); i++) payload[i] = 'a' + i % 26;
+  printf("\nReading fragmented packets, %u messages\n", messages);
+  printf("%8s %10s %14s %18s %14s %10s\n", "payload", "read", "messages/s", "longest loop [us]", "waited [us]", "received");
+  sim::reset();
+  network.reset();
+  PubSubClient mqtt(IPAddress(192, 168, 1, 21), 1883, network);
+  mqtt.setCallback([](char*, uint8_t*, unsigned int) { received++; });
+  mqtt.setKeepAlive(1000); // One byte per pass, the backlog of 200 byte messages takes 43 s to read
+  connectMqtt(mqtt);
+  uint32_t waited{0}; // Most virtual time one loop() took, it only moves when loop() waits for data
+  double longest{0};
+  auto pass = [&]() {
+    uint32_t before = sim::now();
+    auto start = std::chrono::steady_clock::now();
+    mqtt.loop();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (ns > longest) longest = ns;
+    if (sim::now() - before > waited) waited = sim::now() - before;
+    sim::advance(100);
+  };
+  for (uint16_t size : {20, 200}) {
+    for (uint16_t fragment : {1, 7, 64, 0}) {
+      network.setFragment(fragment);
+      received = 0;
+      waited = 0;
+      longest = 0;
+      for (uint32_t i = 0; i < messages; i++) network.publish("domoticz/out", payload, size);
+      auto begin = std::chrono::steady_clock::now();
+      while (received < messages && network.connected()) pass();
+      double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+      printf("%8u %10u %14.0f %18.1f %14u %10u\n", size, fragment ? fragment : 1460, received / s, longest / 1000, waited,
+             received);
+      check("fragmented messages received", received, messages);
+      check("virtual time loop() waited for fragments", waited, 0);
+    }
+  }
+  network.setFragment(0);
+
+  // A packet that stops after its topic for 50 ms, as when a TCP segment is lost and resent
+#if MQTT_VERSION == MQTT_VERSION_5
+  const uint8_t head[]{0x30, 20, 0, 12, 'd', 'o', 'm', 'o', 't', 'i', 'c', 'z', '/', 'o', 'u', 't'};
+  const uint8_t tail[]{0, '1', '2', '3', '4', '5'}; // No properties
+#else
+  const uint8_t head[]{0x30, 19, 0, 12, 'd', 'o', 'm', 'o', 't', 'i', 'c', 'z', '/', 'o', 'u', 't'};
+  const uint8_t tail[]{'1', '2', '3', '4', '5'};
+#endif
+  received = 0;
+  waited = 0;
+  longest = 0;
+  uint32_t passes{0};
+  network.inject(head, sizeof(head));
+  for (uint32_t start = sim::now(); sim::now() - start < 50000; passes++) pass();
+  network.inject(tail, sizeof(tail));
+  while (received == 0 && network.connected()) pass();
+  printf("packet stopped for 50 ms after the topic: %u passes of loop() meanwhile, longest %.1f us, waited %u us, %u received\n",
+         passes, longest / 1000, waited, received);
+  check("stalled message received", received, 1);
+  check("virtual time loop() waited for the stalled packet", waited, 0);
+  mqtt.disconnect();
+}
+
+// Bytes on the wire per message for a few topics that repeat, as status updates do. With
+// MQTT_VERSION 5 ([env:native_mqtt5]) both sides send a topic once with an alias and then only
+// the alias, MQTT 3.1.1 sends the topic every time. Also the state after a refused connection.
+static void reportAliases() {
+  const uint32_t messages{1000};
+  const char* topics[]{"domoticz/in", "dimmer/kitchen/state", "dimmer/hall/state", "dimmer/porch/state"};
+  uint8_t payload[40];
+  memset(payload, 'a', sizeof(payload));
+  printf("\nTopic aliases, MQTT %s, %u messages over %zu topics with a %zu byte payload\n",
+         MQTT_VERSION == MQTT_VERSION_5 ? "5" : "3.1.1", messages, sizeof(topics) / sizeof(topics[0]), sizeof(payload));
+  sim::reset();
+  network.reset();
+  PubSubClient mqtt(IPAddress(192, 168, 1, 21), 1883, network);
+  mqtt.setCallback([](char*, uint8_t*, unsigned int) { received++; });
+  connectMqtt(mqtt);
+  MockClient::Counters before = network.counters();
+  for (uint32_t i = 0; i < messages; i++) mqtt.publish(topics[i % 4], payload, sizeof(payload));
+  MockClient::Counters after = network.counters();
+  printf("publish: %.1f bytes per message, %u of %u sent with the alias alone\n",
+         (double)(after.bytesOut - before.bytesOut) / messages, after.aliased - before.aliased,
+         after.publishes - before.publishes);
+  check("publishes received by the broker", after.publishes - before.publishes, messages);
+  // Each topic goes out once with its alias, MQTT_MAX_TOPIC_ALIASES is 4 by default
+  check("publishes sent with the alias alone", after.aliased - before.aliased,
+        MQTT_VERSION == MQTT_VERSION_5 ? messages - 4 : 0);
+  received = 0;
+  for (uint32_t i = 0; i < messages; i++) network.publish(topics[i % 4], payload, sizeof(payload));
+  pumpMqtt(mqtt, []() { return received == messages; });
+  printf("receive: %.1f bytes per message, %u received\n", (double)(network.counters().bytesIn - after.bytesIn) / messages,
+         received);
+  check("messages received with aliases", received, messages);
+  mqtt.disconnect();
+
+  // The broker refuses the connection for bad credentials
+  network.setConnackCode(MQTT_VERSION == MQTT_VERSION_5 ? 0x86 : 4);
+  connectMqtt(mqtt);
+  printf("connection refused with code 0x%02X: state %d, MQTT_CONNECT_BAD_CREDENTIALS is %d\n",
+         MQTT_VERSION == MQTT_VERSION_5 ? 0x86 : 4, mqtt.state(), MQTT_CONNECT_BAD_CREDENTIALS);
+  check("state after the broker refused the credentials", mqtt.state(), MQTT_CONNECT_BAD_CREDENTIALS);
+  network.setConnackCode(0);
+}
+
+// Cost of finding the handler of an incoming message: addRoute() against one callback comparing
+// the topic with every filter in turn, for 1, 8 and 32 filters without wildcards. Every message
+// goes through the MQTT client, the row without filters is the cost of receiving alone.
+static void reportRoutes() {
+  static char filters[32][24]; // addRoute() keeps the pointers
+  static uint8_t filterCount{0};
+  const uint32_t messages{20000};
+  uint8_t payload[16]{};
+  for (uint8_t i = 0; i < 32; i++) snprintf(filters[i], sizeof(filters[i]), "home/light%u/set", i);
+  printf("\nMatching the topic of incoming messages, %u messages\n", messages);
+  printf("%8s %18s %18s\n", "filters", "addRoute [ns/msg]", "strcmp [ns/msg]");
+  network.reset();
+  for (uint8_t count : {0, 1, 8, 32}) {
+    double ns[2]{1e9, 1e9}; // Best of ten runs, the host is noisy
+    for (uint8_t run = 0; run < 20; run++) {
+      uint8_t trie = run % 2;
+      sim::reset();
+      PubSubClient mqtt(IPAddress(192, 168, 1, 21), 1883, network);
+      filterCount = count;
+      received = 0;
+      if (trie) {
+        for (uint8_t i = 0; i < count; i++) mqtt.addRoute(filters[i], [](char*, uint8_t*, unsigned int) { received++; });
+      } else {
+        mqtt.setCallback([](char* topic, uint8_t*, unsigned int) {
+          for (uint8_t i = 0; i < filterCount; i++) {
+            if (strcmp(topic, filters[i]) == 0) {
+              received++;
+              return;
+            }
+          }
+        });
+      }
+      connectMqtt(mqtt);
+      for (uint32_t i = 0; i < messages; i++) network.publish(filters[count ? i % count : 0], payload, sizeof(payload));
+      auto start = std::chrono::steady_clock::now();
+      pumpMqtt(mqtt, []() { return network.pending() == 0; }, 100000000);
+      ns[trie] = std::min(ns[trie], std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / messages);
+      if (count) check("messages matched by their filter", received, messages);
+      mqtt.disconnect();
+    }
+    if (count == 0) {
+      printf("%8s %37.0f\n", "none", ns[0]);
+    } else {
+      printf("%8u %18.0f %18.0f\n", count, ns[1], ns[0]);
+    }
+  }
+}
+
+// The connection manager through outages of the access point and the broker, with loop() doing
+// what the firmware does besides: the MQTT client and a dimmer, 100 us per pass. Blocking calls
+// would show as virtual time spent inside a pass, or as half cycles without a firing.
+static void reportConnection() {
+  struct Outage {
+    const char* name;
+    bool wifi; // The access point is gone, otherwise only the broker
+    uint32_t duration;
+  };
+  const Outage outages[]{{"WiFi, 5 s", true, 5000000}, {"WiFi, 30 s", true, 30000000},
+                         {"broker, 3 s", false, 3000000}, {"broker, 20 s", false, 20000000}};
+  printf("\nConnection manager through outages, loop() 100 us per pass\n");
+  sim::reset();
+  sim::setMains(50);
+  sim::setWifi(true);
+  network.reset();
+  network.setLatency(5000);
+  PubSubClient mqtt(IPAddress(192, 168, 1, 21), 1883, network);
+  Connection connection(mqtt, "ssid", "password");
+  connection.setMqtt("dimmer", nullptr, nullptr);
+  connection.subscribe("domoticz/out");
+  timed.set(50);
+  uint32_t fires{0};
+  sim::onPinWrite([&fires](uint8_t pin, uint8_t level, uint32_t) {
+    if (pin == TIMERPIN && level == TRIAC_NORMAL_STATE) fires++;
+  });
+  uint32_t longest{0}; // Virtual time in us one pass spent in the calls, 0 when nothing blocks
+  double longestNs{0};
+  auto pass = [&]() {
+    uint32_t before = sim::now();
+    auto start = std::chrono::steady_clock::now();
+    connection.update();
+    mqtt.loop();
+    dimmer.update();
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    if (ns > longestNs) longestNs = ns;
+    if (sim::now() - before > longest) longest = sim::now() - before;
+    sim::advance(100);
+  };
+  auto runUntilConnected = [&](uint32_t limit) {
+    uint32_t start = sim::now();
+    while (!connection.connected() && sim::now() - start < limit) pass();
+    return sim::now() - start;
+  };
+  printf("first connect: %.1f ms\n", runUntilConnected(10000000) / 1000.0);
+  printf("%-14s %12s %13s %14s %16s %14s\n", "outage", "back [ms]", "WiFi begins", "longest [us]", "longest host [us]",
+         "fires/half");
+  for (const Outage& outage : outages) {
+    for (uint32_t start = sim::now(); sim::now() - start < 1000000;) pass();
+    longest = 0;
+    longestNs = 0;
+    fires = 0;
+    uint32_t begins = sim::counters().wifiBegins;
+    uint32_t start = sim::now();
+    if (outage.wifi) sim::setWifi(false);
+    network.setReachable(false);
+    network.drop();
+    while (sim::now() - start < outage.duration) pass();
+    sim::setWifi(true);
+    network.setReachable(true);
+    uint32_t back = runUntilConnected(120000000);
+    double halfcycles = (sim::now() - start) / sim::halfCycle();
+    printf("%-14s %12.1f %13u %14u %16.1f %14.2f\n", outage.name, back / 1000.0, sim::counters().wifiBegins - begins, longest,
+           longestNs / 1000, fires / halfcycles);
+    check("connected again after the outage", connection.connected(), true);
+    check("virtual time a pass blocked during the outage", longest, 0);
+  }
+  sim::onPinWrite(nullptr);
+  timed.set(0);
+}
+
+// Cost of publishing a command to domoticz/in, formatted three ways
+static void reportEncoder() {
+  const char* topic{"domoticz/in"};
+  const uint16_t idx{1385};
+  const uint32_t publishes{20000};
+  printf("\nPublishing switchlight to domoticz/in\n");
+  sim::reset();
+  network.reset();
+  PubSubClient mqtt(IPAddress(192, 168, 1, 21), 1883, network);
+  connectMqtt(mqtt);
+  const char* ways[]{"snprintf", "JSON document", "encoder"};
+  for (uint8_t way = 0; way < 3; way++) {
+    MockClient::Counters before = network.counters();
+    uint32_t allocated = allocations;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < publishes; i++) {
+      uint8_t level = i % 101;
+      if (way == 0) { // What ReportState() did
+        char payload[96];
+        snprintf(payload, sizeof(payload), "{\"command\":\"switchlight\",\"idx\":%u,\"switchcmd\":\"Set Level\",\"level\":%u}",
+                 idx, level);
+        mqtt.publish(topic, payload);
+      } else if (way == 1) {
+        StaticJsonDocument<JSON_OBJECT_SIZE(4)> doc;
+        doc["command"] = "switchlight";
+        doc["idx"] = idx;
+        doc["switchcmd"] = "Set Level";
+        doc["level"] = level;
+        char payload[96];
+        size_t length = serializeJson(doc, payload, sizeof(payload));
+        mqtt.publish(topic, (const uint8_t*)payload, length);
+      } else {
+        domoticzPublish(mqtt, topic, [level](auto& out) { domoticzSwitchlight(out, idx, level); });
+      }
+    }
+    double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    MockClient::Counters after = network.counters();
+    printf("%s: %.0f ns per message, %.2f allocations per message, %.1f writes per message, %u published\n", ways[way],
+           ns / publishes, (double)(allocations - allocated) / publishes, (double)(after.writes - before.writes) / publishes,
+           after.publishes - before.publishes);
+  }
+
+  // The other commands, written into a buffer as for the spool
+  char payload[SPOOL_SLOT_SIZE];
+  const float svalues[]{21.5f, -3.25f, 1013};
+  DomoticzBuffer buffer(payload, sizeof(payload));
+  domoticzUdevice(buffer, 1386, 0, svalues, 3);
+  printf("%s\n", payload);
+  buffer = DomoticzBuffer(payload, sizeof(payload));
+  domoticzSetcolbrightnessvalue(buffer, 1387, 240, 80, false);
+  printf("%s\n", payload);
+  buffer = DomoticzBuffer(payload, sizeof(payload));
+  domoticzAddlogmessage(buffer, "dimmer \"hal\" restarted\n");
+  printf("%s\n", payload);
+  buffer = DomoticzBuffer(payload, 32);
+  domoticzSwitchlight(buffer, idx, "Off");
+  printf("into 32 bytes: overflow %s\n", buffer.overflow ? "set, not spooled" : "not set");
+}
+
+// One node with 32 devices: routing the recorded messages through the table against decoding
+// every message and comparing its idx with each device in turn
+static uint32_t switched{0};
+static uint32_t sensed{0};
+
+static void reportRouter() {
+  const uint32_t rounds{20000};
+  DomoticzRouter devices;
+  uint16_t idxs[DOMOTICZ_MAX_DEVICES];
+  devices.addDimmer(1385, dimmer);
+  devices.addSwitch(27, [](bool) { switched++; });
+  devices.addScene(12, [](bool) { switched++; });
+  devices.addSensor(415, [](const DomoticzMessage&) { sensed++; });
+  for (uint16_t idx = 2000; devices.size() < DOMOTICZ_MAX_DEVICES; idx += 7) devices.addSwitch(idx, [](bool) { switched++; });
+  uint8_t count{0};
+  for (uint16_t idx = 0; idx < 0xFFFF && count < DOMOTICZ_MAX_DEVICES; idx++) {
+    if (devices.has(idx)) idxs[count++] = idx;
+  }
+  uint32_t lengths[domoticzCorpusSize];
+  for (uint16_t i = 0; i < domoticzCorpusSize; i++) lengths[i] = strlen(domoticzCorpus[i]);
+  uint32_t routed{0};
+  uint32_t posted = dimmer.commands().posted;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < rounds; round++) {
+    for (uint16_t i = 0; i < domoticzCorpusSize; i++) {
+      if (devices.dispatch((const uint8_t*)domoticzCorpus[i], lengths[i])) routed++;
+    }
+  }
+  double table = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  uint32_t matched{0};
+  start = std::chrono::steady_clock::now();
+  for (uint32_t round = 0; round < rounds; round++) {
+    for (uint16_t i = 0; i < domoticzCorpusSize; i++) {
+      DomoticzMessage message{};
+      if (!domoticzDecode((const uint8_t*)domoticzCorpus[i], lengths[i], message, domoticzMessageFields)) continue;
+      for (uint8_t d = 0; d < count; d++) {
+        if (idxs[d] == message.idx) {
+          matched++;
+          break;
+        }
+      }
+    }
+  }
+  double scan = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  uint32_t messages = rounds * domoticzCorpusSize;
+  posted = dimmer.commands().posted - posted;
+  printf("\nRouting %u recorded messages to %u devices, table %zu bytes on the host\n", domoticzCorpusSize, devices.size(),
+         sizeof(devices));
+  printf("routing table: %.0f ns per message, %u of %u routed (%u switch, %u sensor, %u dimmer)\n", table / messages, routed,
+         messages, switched, sensed, posted);
+  printf("decode all, compare each idx: %.0f ns per message, %u of %u matched\n", scan / messages, matched, messages);
+  // Levels out of range from the broker
+  sim::reset();
+  sim::setMains(50);
+  const struct {
+    const char* level;
+    uint8_t target;
+  } levels[] = {{"300", 100}, {"-5", 0}, {"45.7", 45}, {"1e39", 100}};
+  for (const auto& entry : levels) {
+    const char* level = entry.level;
+    char message[80];
+    int n = snprintf(message, sizeof(message), "{\"idx\":1385,\"nvalue\":2,\"svalue1\":\"%s\"}", level);
+    devices.dispatch((const uint8_t*)message, n);
+    runLoop(20000, 20);
+    printf("svalue1 %-5s: dimmer target %u\n", level, dimmer.target());
+    check("dimmer target of an svalue1 out of range", dimmer.target(), entry.target);
+  }
+}
+
+int main() {
+  dimmer.begin(0);
+  timed.begin(0);
+  for (Dimmer& channel : channels) channel.begin(0);
+  reportFiring();
+  reportChannels();
+  reportTracking();
+  reportStats();
+  reportIsrCost();
+  reportCurves();
+  reportRamp();
+  reportCommands();
+  reportSpool();
+  reportMqtt();
+  reportCopies();
+  reportReader();
+  reportAliases();
+  reportRoutes();
+  reportConnection();
+  reportDomoticz();
+  reportEncoder();
+  reportRouter();
+  printf("\n%u checks, %u failed\n", checks, checksFailed);
+  return checksFailed ? 1 : 0;
+}